@@ -20,7 +20,15 @@
 #define LOGICAL_DISK_SIZE	(95 * 1024 * 1024)
 #define LOGICAL_DISK_SECTORS	((LOGICAL_DISK_SIZE) / (KERNEL_SECTOR_SIZE))
 
-/* sync data */
+/* full resync of the legs, the argument is SSR_SYNC_START or SSR_SYNC_CANCEL */
 #define SSR_IOCTL_SYNC		1
+#define SSR_SYNC_START		0
+#define SSR_SYNC_CANCEL		1
+
+/* on-disk superblock, in the last SSR_SB_SECTORS sectors of every leg;
+ * legs without one use the format above
+ */
+#define SSR_SB_MAGIC		0x3144494152525353ULL		/* "SSRRAID1" */
+#define SSR_SB_SECTORS		8
 
 #endif
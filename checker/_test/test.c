@@ -1,10 +1,15 @@
+#define _LARGEFILE64_SOURCE
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <linux/fs.h>
 
 #include "run-test.h"
 #include "ssr.h"
@@ -1680,6 +1685,320 @@ static void dual_error(void)
 	cleanup_test();
 }
 
+/*
+ * Superblock tests: the module is loaded again with other parameters and
+ * the legs go back to the format from before the superblock at the end,
+ * the one the other tests expect.
+ */
+
+#define SSR_PARAMS_DIR		"/sys/module/" SSR_BASE_NAME "/parameters/"
+#define SSR_SB_SIZE		(SSR_SB_SECTORS * KERNEL_SECTOR_SIZE)
+
+static int reload_module(const char *params)
+{
+	char cmd[256];
+
+	flush_disk_buffers();
+	system("/sbin/rmmod " SSR_BASE_NAME " > /dev/null 2>&1");
+	snprintf(cmd, sizeof(cmd), "/sbin/insmod " SSR_MOD_NAME " %s", params);
+	return system(cmd) == 0;
+}
+
+static unsigned long long disk_size(int fd)
+{
+	uint64_t size = 0;
+
+	ioctl(fd, BLKGETSIZE64, &size);
+	return size;
+}
+
+static ssize_t sb_io(const char *name, void *buffer, int do_write)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(name, O_RDWR);
+	if (fd < 0)
+		return -1;
+	lseek64(fd, disk_size(fd) - SSR_SB_SIZE, SEEK_SET);
+	n = do_write ? xwrite(fd, buffer, SSR_SB_SIZE) : xread(fd, buffer, SSR_SB_SIZE);
+	close(fd);
+
+	return n;
+}
+
+static int sb_present(const char *name)
+{
+	unsigned char sb[SSR_SB_SIZE];
+	uint64_t magic;
+
+	if (sb_io(name, sb, 0) != SSR_SB_SIZE)
+		return 0;
+	memcpy(&magic, sb, sizeof(magic));
+	return magic == SSR_SB_MAGIC;
+}
+
+static void restore_legacy(void)
+{
+	unsigned char zero[SSR_SB_SIZE];
+
+	memset(zero, 0, sizeof(zero));
+	flush_disk_buffers();
+	system("/sbin/rmmod " SSR_BASE_NAME " > /dev/null 2>&1");
+	sb_io(PHYSICAL_DISK1_NAME, zero, 1);
+	sb_io(PHYSICAL_DISK2_NAME, zero, 1);
+	assert(reload_module(""));
+}
+
+static ssize_t read_param(const char *name, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = xread(fd, buf, len - 1);
+	close(fd);
+	if (n >= 0)
+		buf[n] = '\0';
+
+	return n;
+}
+
+static int write_param(const char *name, const char *val)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(name, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	n = write(fd, val, strlen(val));
+	close(fd);
+
+	return n == (ssize_t) strlen(val) ? 0 : -1;
+}
+
+/* wait up to a minute for every leg to be active */
+static int wait_legs_active(void)
+{
+	char buf[1024];
+	int i;
+
+	for (i = 0; i < 600; i++) {
+		if (read_param(SSR_PARAMS_DIR "legs_state", buf, sizeof(buf)) > 0 &&
+				!strstr(buf, "rebuilding") && !strstr(buf, "failed") &&
+				!strstr(buf, "missing"))
+			return 1;
+		usleep(100000);
+	}
+
+	return 0;
+}
+
+static ssize_t log_io(void *buffer, size_t len, off_t offset, int do_write)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(LOGICAL_DISK_NAME, O_RDWR);
+	if (fd < 0)
+		return -1;
+	lseek(fd, offset, SEEK_SET);
+	n = do_write ? xwrite(fd, buffer, len) : xread(fd, buffer, len);
+	if (do_write && fsync(fd) < 0)
+		n = -1;
+	close(fd);
+
+	return n;
+}
+
+static void superblock_legacy_fallback(void)
+{
+	unsigned long long size = 0;
+	int ok, rc_data, rc_crc;
+	size_t len = ONE_PAGE;
+	int fd;
+
+	/* a new array writes its superblock on both legs and keeps its size */
+	ok = reload_module("create=1");
+	flush_disk_buffers();
+	ok = ok && sb_present(PHYSICAL_DISK1_NAME) && sb_present(PHYSICAL_DISK2_NAME);
+	fd = open(LOGICAL_DISK_NAME, O_RDONLY);
+	if (fd >= 0) {
+		size = disk_size(fd);
+		close(fd);
+	}
+	ok = ok && reload_module("");
+	fd = open(LOGICAL_DISK_NAME, O_RDONLY);
+	ok = ok && fd >= 0 && disk_size(fd) == size;
+	if (fd >= 0)
+		close(fd);
+
+	log_fill_buffer(len);
+	ok = ok && log_io(log_wr_buf, len, 0, 1) == (ssize_t) len;
+	flush_disk_buffers();
+	ok = ok && log_io(log_rd_buf, len, 0, 0) == (ssize_t) len &&
+		memcmp(log_rd_buf, log_wr_buf, len) == 0;
+
+	/* without superblocks the legs are in the original format again */
+	restore_legacy();
+	init_test();
+	log_fill_buffer(len);
+	log_write_start(len);
+	flush_disk_buffers();
+	phys1_read_start(len);
+	rc_data = cmp_data_log_wr_phys1_rd(len);
+	rc_crc = cmp_crc_log_wr_phys1_rd(len);
+	ok = ok && disk_size(log_fd) == LOGICAL_DISK_SIZE && rc_data == 0 && rc_crc == 0;
+	cleanup_test();
+
+	basic_test(ok);
+}
+
+static void discard_unaligned_4k_block(void)
+{
+	/* from sector 1 to the first sector of the third block */
+	uint64_t range[2] = { ONE_SECTOR, TWO_PAGES };
+	size_t len = 3 * ONE_PAGE;
+	int ok, fd;
+
+	ok = reload_module("create=1 csum_block=4096");
+	log_fill_buffer(len);
+	ok = ok && log_io(log_wr_buf, len, 0, 1) == (ssize_t) len;
+
+	fd = open(LOGICAL_DISK_NAME, O_RDWR);
+	ok = ok && fd >= 0 && ioctl(fd, BLKDISCARD, range) == 0;
+	if (fd >= 0)
+		close(fd);
+	flush_disk_buffers();
+
+	/* only the whole block is zeroed, unless a leg cannot zero and the
+	 * discard is dropped; the edges keep their data and CRCs
+	 */
+	ok = ok && log_io(log_rd_buf, len, 0, 0) == (ssize_t) len;
+	if (ok && memcmp(log_rd_buf, log_wr_buf, len) != 0) {
+		memset(log_wr_buf + ONE_PAGE, 0, ONE_PAGE);
+		ok = memcmp(log_rd_buf, log_wr_buf, len) == 0;
+	}
+
+	/* the zeroes are on the legs and verify against their CRCs after a reload */
+	ok = ok && reload_module("");
+	ok = ok && log_io(log_rd_buf, len, 0, 0) == (ssize_t) len &&
+		memcmp(log_rd_buf, log_wr_buf, len) == 0;
+
+	restore_legacy();
+	basic_test(ok);
+}
+
+static void leg_failure_re_add(void)
+{
+	char buf[1024];
+	size_t len = ONE_MEG;
+	int ok, fd;
+
+	/* the second leg held exclusively cannot be opened by the module */
+	ok = reload_module("create=1");
+	system("/sbin/rmmod " SSR_BASE_NAME " > /dev/null 2>&1");
+	fd = open(PHYSICAL_DISK2_NAME, O_RDWR | O_EXCL);
+	ok = ok && fd >= 0 && reload_module("");
+	ok = ok && read_param(SSR_PARAMS_DIR "legs_state", buf, sizeof(buf)) > 0 &&
+		strstr(buf, "missing") != NULL;
+
+	/* written degraded, then copied to the leg once it is back */
+	log_fill_buffer(len);
+	ok = ok && log_io(log_wr_buf, len, 0, 1) == (ssize_t) len;
+	if (fd >= 0)
+		close(fd);
+	ok = ok && write_param(SSR_PARAMS_DIR "re_add", "1") == 0 && wait_legs_active();
+
+	flush_disk_buffers();
+	phys1_fd = open(PHYSICAL_DISK1_NAME, O_RDONLY);
+	phys2_fd = open(PHYSICAL_DISK2_NAME, O_RDONLY);
+	ok = ok && read_whence_data(phys1_fd, phys1_rd_buf, len, START) == (ssize_t) len &&
+		read_whence_data(phys2_fd, phys2_rd_buf, len, START) == (ssize_t) len &&
+		cmp_data_log_wr_phys1_rd(len) == 0 && cmp_data_log_wr_phys2_rd(len) == 0;
+	close(phys1_fd);
+	close(phys2_fd);
+
+	restore_legacy();
+	basic_test(ok);
+}
+
+/* wait up to a minute for the resync to end */
+static int wait_resync_idle(void)
+{
+	char buf[64];
+	int i;
+
+	for (i = 0; i < 600; i++) {
+		if (read_param(SSR_PARAMS_DIR "resync", buf, sizeof(buf)) > 0 &&
+				strncmp(buf, "idle", 4) == 0)
+			return 1;
+		usleep(100000);
+	}
+
+	return 0;
+}
+
+static void resync_start_complete(void)
+{
+	size_t len = ONE_MEG;
+	int ok;
+
+	/* the first leg gets new data, the second one keeps the one of init_test() */
+	init_test();
+	phys_fill_buffer(len);
+	phys1_write_start(len);
+	flush_disk_buffers();
+
+	ok = ioctl(log_fd, SSR_IOCTL_SYNC, SSR_SYNC_START) == 0 && wait_resync_idle();
+
+	/* the second leg is a copy of the first one, data and CRCs */
+	flush_disk_buffers();
+	ok = ok && phys1_read_start(len) == (ssize_t) len && phys2_read_start(len) == (ssize_t) len &&
+		memcmp(phys1_rd_buf, phys1_wr_buf, len) == 0 &&
+		memcmp(phys2_rd_buf, phys1_rd_buf, len) == 0 &&
+		memcmp(phys2_rd_crc, phys1_rd_crc, len / ONE_SECTOR * CRC_SIZE) == 0;
+	cleanup_test();
+
+	basic_test(ok);
+}
+
+static void resync_cancel(void)
+{
+	int ok, rc_start, rc_busy, err_busy, rc_cancel, rc_unknown, err_unknown;
+	char buf[64];
+	int fd;
+
+	/* one chunk in flight at a time, so that the cancel comes in the middle */
+	ok = write_param(SSR_PARAMS_DIR "resync_depth", "1") == 0;
+
+	fd = open(LOGICAL_DISK_NAME, O_RDWR);
+	assert(fd >= 0);
+	rc_start = ioctl(fd, SSR_IOCTL_SYNC, SSR_SYNC_START);
+	rc_busy = ioctl(fd, SSR_IOCTL_SYNC, SSR_SYNC_START);
+	err_busy = errno;
+	rc_cancel = ioctl(fd, SSR_IOCTL_SYNC, SSR_SYNC_CANCEL);
+	ok = ok && rc_start == 0 && rc_busy == -1 && err_busy == EBUSY && rc_cancel == 0 &&
+		wait_resync_idle();
+
+	/* it stopped before the end of the disk */
+	ok = ok && read_param(SSR_PARAMS_DIR "resync_position", buf, sizeof(buf)) > 0 &&
+		strtoull(buf, NULL, 10) < LOGICAL_DISK_SECTORS;
+
+	/* cancelling with nothing running is fine, unknown commands are not */
+	ok = ok && ioctl(fd, SSR_IOCTL_SYNC, SSR_SYNC_CANCEL) == 0;
+	rc_unknown = ioctl(fd, SSR_IOCTL_SYNC + 1, SSR_SYNC_START);
+	err_unknown = errno;
+	ok = ok && rc_unknown == -1 && err_unknown == ENOTTY;
+	close(fd);
+
+	write_param(SSR_PARAMS_DIR "resync_depth", "4");
+	basic_test(ok);
+}
+
 struct run_test_t test_array[] = {
 	{ open_logical, "open(" LOGICAL_DISK_NAME ")", 4 },
 	{ close_logical, "close(" LOGICAL_DISK_NAME ")", 4 },
@@ -1759,8 +2078,13 @@ struct run_test_t test_array[] = {
 	{ recover_ten_page_in_one_meg_disk2, "recover ten pages error in 1MB from disk2", 18 },
 	{ recover_one_meg_disk2, "recover 1MB filled with errors from disk2", 18 },
 	{ dual_error, "signal error when both physical disks are corrupted", 12 },
+	{ superblock_legacy_fallback, "superblock written and legacy format without it", 20 },
+	{ discard_unaligned_4k_block, "unaligned discard with 4KB checksum blocks", 20 },
+	{ leg_failure_re_add, "write with a missing leg and re-add it", 20 },
+	{ resync_start_complete, "full resync copies the first leg to the second", 20 },
+	{ resync_cancel, "full resync cancelled in the middle", 20 },
 };
-size_t max_points = 900;
+size_t max_points = 1000;
 
 /* Return number of tests in test_array. */
 size_t get_num_tests(void)
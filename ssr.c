@@ -12,7 +12,20 @@
 #include <linux/sched.h>
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/crc32.h>
+#include <linux/xxhash.h>
+#include <linux/ktime.h>
+#include <asm/unaligned.h>
+#include <crypto/hash.h>
+#include <linux/hash.h>
+#include <linux/interval_tree_generic.h>
+#include <linux/mempool.h>
+#include <linux/kthread.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/uuid.h>
 #include "ssr.h"
 
 MODULE_AUTHOR("Grigorie Ruxandra <ruxi.grigorie@gmail.com");
@@ -20,400 +33,5323 @@ MODULE_AUTHOR("Orzata Miruna Narcisa <mirunaorzata21@gmail.com");
 MODULE_DESCRIPTION("RAID1 Driver");
 MODULE_LICENSE("GPL");
 
+/* Every allocation of the I/O path comes from a reserve sized for at least
+ * one bio of PRETTY_MAX_SECTORS, so the driver makes progress even when no
+ * memory can be reclaimed. The pretty_bio lives in the front_pad of bio_set,
+ * the one of a sub-bio that runs the whole path on its own in the front_pad
+ * of that bio, from split_bio_set or edge_bio_set, so that no bio waits for
+ * a reserve its parent holds, see pretty_bio_child(). Aligned copies come
+ * from align_bio_set and the bios sent to the disks from io_bio_set. A bio
+ * takes the pages it needs from each page pool at once, for its worst case,
+ * and its per block arrays from block_pool when kmalloc has nothing; one
+ * that finds a pool short waits for it off the worker, see pretty_pool_get().
+ */
+#define PRETTY_MAX_SECTORS		(BIO_MAX_PAGES * (PAGE_SIZE / KERNEL_SECTOR_SIZE))
+#define PRETTY_MAX_BLOCKS		PRETTY_MAX_SECTORS
+#define PRETTY_BIO_POOL_SIZE	64
+/* CRC range of the largest bio: 8-byte slots of 512-byte blocks, plus the edges */
+#define PRETTY_CRC_RANGE_PAGES	DIV_ROUND_UP((PRETTY_MAX_BLOCKS * sizeof(u64) / KERNEL_SECTOR_SIZE + 2) * \
+					     KERNEL_SECTOR_SIZE, PAGE_SIZE)
+#define PRETTY_CRC_POOL_PAGES	(4 * PRETTY_CRC_RANGE_PAGES)
+/* the aligned copy of the largest bio is up to two blocks of a page longer */
+#define PRETTY_BOUNCE_POOL_PAGES	(BIO_MAX_PAGES + 2)
+#define PRETTY_EDGE_POOL_PAGES	16
+#define PRETTY_BLOCK_POOL_SIZE	4
+
+/* Every bio is driven by a small state machine: a stage submits its I/Os and
+ * returns, the last completing I/O queues the work again and the worker runs
+ * pb->next. This way the worker never sleeps on a disk and can keep many bios
+ * in flight at the same time.
+ */
 struct pretty_bio {
-struct work_struct work;
-struct bio *bio;
+	struct work_struct work;
+	struct bio *bio;
+	struct request *rq;								// request of the bio with the blk-mq front end
+
+	atomic_t pending;								// sub-I/Os in flight + 1 for the running stage
+	void (*next)(struct pretty_bio *pb);			// stage to run when pending drops to 0
+	blk_status_t io_status;							// last error reported by a sub-I/O
+	int err;
+	u8 repair_mask;									// legs repaired by a read, see pretty_read_repair()
+	bool scrub;										// issued by the scrubber, see pretty_scrub_thread()
+	bool resync;									// chunk of a full resync, see pretty_resync_start()
+	bool marked;									// counted in the write-intent bitmap, see pretty_bitmap_mark()
+
+	/* CRC sectors touched by the bio, see pretty_range_lock() */
+	struct rb_node range_rb;
+	unsigned long long first_crc, last_crc, range_subtree_last;
+	unsigned long range_seq;
+	unsigned int range_blockers;
+	bool locked;
+
+	/* in-memory copy of the CRC range, for a read also the one of the leg
+	 * checked, both in crc_page_array, see pretty_reserve()
+	 */
+	struct page **crc_pages, **crc_pages_secondary;
+	struct page *crc_page_array[2 * PRETTY_CRC_RANGE_PAGES];
+	unsigned int nr_crc_pages;
+	bool crc_from_disk;
+	blk_status_t crc_status;						// of the read of crc_pages, see pretty_crc_range_retry()
+	u8 crc_legs;									// legs crc_pages was read from
+
+	/* waiting for the CRC cache write-back, see crc_cache_sync(), or for a
+	 * reserve, see pretty_pool_get()
+	 */
+	struct list_head wait_node;
+	unsigned long wb_seq;
+
+	/* legs of a read: the one read first, < 0 until chosen, and the one
+	 * checked next, see pretty_read_choose_leg() and pretty_read_next_leg()
+	 */
+	int primary, secondary;
+
+	/* per checksum block state of a read, see pretty_read_verify(), in
+	 * one allocation, see pretty_alloc_blocks()
+	 */
+	unsigned int nr_blocks;
+	u64 *checksums;
+	u8 *sector_state;
+	u8 *block_repair;								// legs to rewrite with the good copy
+	u8 *gather;										// one block split across segments, see compute_crc_bio()
+	struct page **bounce_pages;
+	unsigned int nr_bounce_pages;
+	bool blocks_from_pool;
+	bool queue_ref;												// holds the queue of the array, see pretty_submit_bio()
+
+	/* bio as submitted when it does not start and end on a checksum block,
+	 * pb->bio is then its block aligned copy, see pretty_align_bio()
+	 */
+	struct bio *orig_bio;
+	struct page *edge_pages[2];
+
+	/* must be last: the pretty_bio is the front_pad of this bio, see pretty_bio_get() and pretty_bio_child() */
+	struct bio ctx_bio;
 };
 
-static struct pretty_block_dev {
-struct gendisk *gd;
+/* sector_state flags of a read, one per checksum block */
+enum {
+	SECTOR_BAD		= 1 << 0,		// no leg with a valid CRC found yet
+	SECTOR_CHECK	= 1 << 1,		// good on the primary, compared with the other legs
+	SECTOR_READ		= 1 << 2,		// copy of the leg checked read into the bounce slot
+};
 
-struct block_device *phys_bdev_1;
-struct block_device *phys_bdev_2;
+/* A reserve of the I/O path. A bio short of elements parks on it instead of
+ * sleeping in its worker and runs again from the stage it gave once
+ * elements come back, see pretty_pool_get().
+ */
+struct pretty_pool {
+	mempool_t pool;
+	spinlock_t lock;
+	struct list_head waiters;
+};
 
-struct workqueue_struct *queue;
+static struct pretty_block_dev {
+	struct gendisk *gd;
+
+	struct block_device *legs[SSR_MAX_LEGS];					// NULL for a leg missing at load time
+	unsigned int nr_legs;
+
+	/* legs read and written, legs only written until rebuilt, see pretty_leg_fail() */
+	unsigned long active, rebuilding;
+	spinlock_t leg_lock;
+
+	/* superblock of the array, rewritten when the legs change, see pretty_sb_update() */
+	struct page *sb_page;
+	bool sb_changed, sb_pending;
+	struct list_head sb_waiters;
+	struct work_struct sb_work;
+
+	struct workqueue_struct *queue;
+	struct blk_mq_tag_set tag_set;
+
+	/* on-disk format, see pretty_sb_load() */
+	u32 csum_alg;
+	unsigned int csum_size;										// bytes of a CRC slot, 0 without checksums
+	unsigned int csum_shift;									// log2 of the data sectors per checksum
+	u64 zero_csum;												// checksum of a block of zeroes, see pretty_zero_crc()
+	unsigned long *zeroed;										// CRC sectors of zeroes, see pretty_zeroed_update()
+	spinlock_t zeroed_lock;
+	unsigned long long data_sectors;							// capacity, the CRC area starts right after
+	unsigned int bitmap_shift;									// log2 of the sectors per write-intent region, 0 without
+
+	/* reserves for the I/O path, see pretty_mem_init() */
+	struct bio_set bio_set;
+	struct bio_set split_bio_set;
+	struct bio_set edge_bio_set;
+	struct bio_set align_bio_set;
+	struct bio_set io_bio_set;
+	struct pretty_pool crc_page_pool;
+	struct pretty_pool bounce_page_pool;
+	struct pretty_pool edge_page_pool;
+	struct pretty_pool block_pool;
+
+	/* bios that own a CRC range or wait for one, by CRC sectors */
+	spinlock_t range_lock;
+	struct rb_root_cached range_tree;
+	unsigned long range_seq;
+
+	/* jiffies of the last bio submitted to /dev/ssr */
+	unsigned long last_io;
+
+	/* per-leg I/O in flight and sector after the last I/O, indexed by pretty_leg() */
+	atomic_t inflight[SSR_MAX_LEGS];
+	unsigned long long head[SSR_MAX_LEGS];
+	atomic_t read_turn;
 } pretty_dev;
 
-void locate_crc_on_disks(unsigned long long data_sector, unsigned long long *crc_sector, unsigned long long *crc_offset)
+/* one CRC slot of csum_size bytes covers a block of CSUM_BLOCK_SECTORS data
+ * sectors; DATA_SECTORS_PER_CRC_SECTOR is only valid with checksums
+ */
+#define CSUM_BLOCK_SECTORS		(1U << pretty_dev.csum_shift)
+#define CSUM_BLOCK_SIZE			(KERNEL_SECTOR_SIZE << pretty_dev.csum_shift)
+#define DATA_SECTORS_PER_CRC_SECTOR	((KERNEL_SECTOR_SIZE / pretty_dev.csum_size) << pretty_dev.csum_shift)
+
+/* first sector after the CRC area */
+#define CRC_AREA_END	(pretty_dev.data_sectors +								\
+			 (pretty_dev.csum_size ? DIV_ROUND_UP(pretty_dev.data_sectors, DATA_SECTORS_PER_CRC_SECTOR) : 0))
+
+/* the write-intent bitmap follows the CRC area, one bit per region */
+#define BITMAP_REGIONS	DIV_ROUND_UP_ULL(pretty_dev.data_sectors, 1ULL << pretty_dev.bitmap_shift)
+#define BITMAP_SECTORS	(pretty_dev.bitmap_shift ? DIV_ROUND_UP_ULL(BITMAP_REGIONS, KERNEL_SECTOR_SIZE * 8) : 0)
+
+void locate_crc_on_disks(unsigned long long data_sector, unsigned long long *crc_sector, unsigned long long *crc_offset)
+{
+	unsigned long long crc_address, block = data_sector >> pretty_dev.csum_shift;
+
+	crc_address = pretty_dev.data_sectors * KERNEL_SECTOR_SIZE + block * pretty_dev.csum_size;
+	*crc_sector = pretty_dev.data_sectors + block / (KERNEL_SECTOR_SIZE / pretty_dev.csum_size);
+	*crc_offset = crc_address - KERNEL_SECTOR_SIZE * (*crc_sector);
+}
+
+/* CRC sectors covering the data sectors of the bio */
+static void locate_crc_range(struct pretty_bio *pb)
+{
+	unsigned long long offset;
+
+	/* no CRC area: the range lock covers the data sectors themselves */
+	if (!pretty_dev.csum_size) {
+		pb->first_crc = pb->bio->bi_iter.bi_sector;
+		pb->last_crc = bio_end_sector(pb->bio) - 1;
+		return;
+	}
+
+	locate_crc_on_disks(pb->bio->bi_iter.bi_sector, &pb->first_crc, &offset);
+	locate_crc_on_disks(bio_end_sector(pb->bio) - 1, &pb->last_crc, &offset);
+
+	pb->nr_crc_pages = DIV_ROUND_UP((pb->last_crc - pb->first_crc + 1) * KERNEL_SECTOR_SIZE, PAGE_SIZE);
+}
+
+/* index of a leg in pretty_dev.legs, -1 for a disk that is not a leg */
+static int pretty_leg(struct gendisk *gd)
+{
+	int leg;
+
+	for (leg = 0; leg < pretty_dev.nr_legs; leg++)
+		if (READ_ONCE(pretty_dev.legs[leg]) && READ_ONCE(pretty_dev.legs[leg])->bd_disk == gd)
+			return leg;
+
+	return -1;
+}
+
+/* swapped by pretty_leg_swap() while the leg is out of the array */
+static struct gendisk *pretty_leg_disk(int leg)
+{
+	return READ_ONCE(pretty_dev.legs[leg])->bd_disk;
+}
+
+/* Degraded mode: a leg that fails a write leaves the active legs and the
+ * array runs on the others. Reads only go to the active legs, writes also
+ * go to the legs being rebuilt, see pretty_leg_re_add(). The superblocks
+ * record the legs left out before any bio completes, so a stale leg is not
+ * trusted again after a reload. An array from before the superblock has
+ * nowhere to record it and never runs degraded: the bio fails instead.
+ */
+static unsigned long pretty_writable_legs(void)
+{
+	return READ_ONCE(pretty_dev.active) | READ_ONCE(pretty_dev.rebuilding);
+}
+
+/* one I/O of leg less in flight, pretty_leg_swap() waits for the last one */
+static void pretty_leg_dec(int leg)
+{
+	if (atomic_dec_and_test(&pretty_dev.inflight[leg]))
+		wake_up_var(&pretty_dev.inflight[leg]);
+}
+
+/* The writable legs for I/O outside of the bios of the array, each held in
+ * flight until pretty_put_legs(). pretty_leg_swap() takes a leg out first
+ * and then waits for its in-flight count, so it either waits for the caller
+ * or the caller does not see the leg.
+ */
+static unsigned long pretty_get_writable_legs(void)
+{
+	unsigned long legs;
+	int leg;
+
+	for (leg = 0; leg < pretty_dev.nr_legs; leg++)
+		atomic_inc(&pretty_dev.inflight[leg]);
+	smp_mb__after_atomic();
+
+	legs = pretty_writable_legs();
+	for (leg = 0; leg < pretty_dev.nr_legs; leg++)
+		if (!(legs & BIT(leg)))
+			pretty_leg_dec(leg);
+
+	return legs;
+}
+
+static void pretty_put_legs(unsigned long legs)
+{
+	int leg;
+
+	for_each_set_bit(leg, &legs, pretty_dev.nr_legs)
+		pretty_leg_dec(leg);
+}
+
+static int pretty_first_leg(void)
+{
+	return __ffs(READ_ONCE(pretty_dev.active));
+}
+
+/* next active leg after leg in leg order, -1 once stop is reached */
+static int pretty_next_leg(int leg, int stop)
+{
+	unsigned long active = READ_ONCE(pretty_dev.active);
+	unsigned int i;
+
+	for (i = 0; i < pretty_dev.nr_legs; i++) {
+		leg = (leg + 1) % pretty_dev.nr_legs;
+		if (leg == stop)
+			return -1;
+		if (active & BIT(leg))
+			return leg;
+	}
+
+	return -1;
+}
+
+static bool pretty_degraded(void)
+{
+	return READ_ONCE(pretty_dev.active) != GENMASK(pretty_dev.nr_legs - 1, 0);
+}
+
+/* the superblocks are rewritten by pretty_sb_update() */
+static void pretty_sb_changed(bool pending)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&pretty_dev.leg_lock, flags);
+	pretty_dev.sb_changed = true;
+	pretty_dev.sb_pending |= pending;
+	spin_unlock_irqrestore(&pretty_dev.leg_lock, flags);
+
+	queue_work(pretty_dev.queue, &pretty_dev.sb_work);
+}
+
+/* leave leg out of the array, returns false when it is the last active leg
+ * or the array has no superblock
+ */
+static bool pretty_leg_remove(int leg, const char *reason)
+{
+	unsigned long flags;
+	bool last = false, failed = false;
+
+	if (!pretty_dev.sb_page)
+		return false;
+
+	spin_lock_irqsave(&pretty_dev.leg_lock, flags);
+	if (pretty_dev.active == BIT(leg)) {
+		last = true;
+	} else if ((pretty_dev.active | pretty_dev.rebuilding) & BIT(leg)) {
+		WRITE_ONCE(pretty_dev.active, pretty_dev.active & ~BIT(leg));
+		WRITE_ONCE(pretty_dev.rebuilding, pretty_dev.rebuilding & ~BIT(leg));
+		failed = true;
+	}
+	spin_unlock_irqrestore(&pretty_dev.leg_lock, flags);
+
+	if (failed) {
+		pr_err("leg %d %s, running degraded\n", leg, reason);
+		pretty_sb_changed(true);
+	}
+
+	return !last;
+}
+
+/* a write failed on leg: the error goes to the bio when the leg cannot be left out */
+static bool pretty_leg_fail(int leg)
+{
+	return pretty_leg_remove(leg, "failed");
+}
+
+static void pretty_bio_complete(struct pretty_bio *pb);
+
+/* a bio completes once the superblocks tell the legs it missed, see pretty_sb_update() */
+static bool pretty_sb_wait(struct pretty_bio *pb)
+{
+	bool wait;
+
+	spin_lock_irq(&pretty_dev.leg_lock);
+	wait = pretty_dev.sb_pending;
+	if (wait) {
+		pb->next = pretty_bio_complete;
+		list_add_tail(&pb->wait_node, &pretty_dev.sb_waiters);
+	}
+	spin_unlock_irq(&pretty_dev.leg_lock);
+
+	return wait;
+}
+
+static void pretty_io_put(struct pretty_bio *pb)
+{
+	if (atomic_dec_and_test(&pb->pending))
+		queue_work(pretty_dev.queue, &pb->work);
+}
+
+void work_handler(struct work_struct *work)
+{
+	struct pretty_bio *pb = container_of(work, struct pretty_bio, work);
+
+	/* the running stage owns one reference until it called pretty_io_put() */
+	atomic_set(&pb->pending, 1);
+	pb->next(pb);
+}
+
+static struct pretty_bio *pretty_bio_init(struct bio *ctx_bio)
+{
+	struct pretty_bio *pb = container_of(ctx_bio, struct pretty_bio, ctx_bio);
+
+	memset(pb, 0, offsetof(struct pretty_bio, ctx_bio));
+	INIT_WORK(&pb->work, work_handler);
+	pb->primary = -1;
+
+	return pb;
+}
+
+/* never fails as long as gfp allows to wait */
+static struct pretty_bio *pretty_bio_get(gfp_t gfp)
+{
+	return pretty_bio_init(bio_alloc_bioset(gfp, 0, &pretty_dev.bio_set));
+}
+
+/* per checksum block arrays, gather block and bounce slot pointers of a bio */
+static size_t pretty_blocks_size(unsigned int nr_blocks, unsigned int nr_bounce_pages)
+{
+	return nr_blocks * (sizeof(u64) + 2 * sizeof(u8)) + CSUM_BLOCK_SIZE +
+	       nr_bounce_pages * sizeof(struct page *);
+}
+
+static void pretty_pool_init(struct pretty_pool *pp)
+{
+	spin_lock_init(&pp->lock);
+	INIT_LIST_HEAD(&pp->waiters);
+}
+
+static int pretty_mem_init(void)
+{
+	unsigned int front_pad = offsetof(struct pretty_bio, ctx_bio);
+	int err;
+
+	pretty_pool_init(&pretty_dev.crc_page_pool);
+	pretty_pool_init(&pretty_dev.bounce_page_pool);
+	pretty_pool_init(&pretty_dev.edge_page_pool);
+	pretty_pool_init(&pretty_dev.block_pool);
+
+	err = bioset_init(&pretty_dev.bio_set, PRETTY_BIO_POOL_SIZE, front_pad, 0);
+	if (err)
+		return err;
+
+	err = bioset_init(&pretty_dev.split_bio_set, PRETTY_BIO_POOL_SIZE, front_pad, BIOSET_NEED_BVECS);
+	if (err)
+		goto out_exit_bio_set;
+
+	err = bioset_init(&pretty_dev.edge_bio_set, PRETTY_BIO_POOL_SIZE, front_pad, BIOSET_NEED_BVECS);
+	if (err)
+		goto out_exit_split_bio_set;
+
+	err = bioset_init(&pretty_dev.align_bio_set, PRETTY_BIO_POOL_SIZE, 0, BIOSET_NEED_BVECS);
+	if (err)
+		goto out_exit_edge_bio_set;
+
+	err = bioset_init(&pretty_dev.io_bio_set, PRETTY_BIO_POOL_SIZE, 0, BIOSET_NEED_BVECS);
+	if (err)
+		goto out_exit_align_bio_set;
+
+	err = mempool_init_page_pool(&pretty_dev.crc_page_pool.pool, PRETTY_CRC_POOL_PAGES, 0);
+	if (err)
+		goto out_exit_io_bio_set;
+
+	err = mempool_init_page_pool(&pretty_dev.bounce_page_pool.pool, PRETTY_BOUNCE_POOL_PAGES, 0);
+	if (err)
+		goto out_exit_crc_page_pool;
+
+	err = mempool_init_page_pool(&pretty_dev.edge_page_pool.pool, PRETTY_EDGE_POOL_PAGES, 0);
+	if (err)
+		goto out_exit_bounce_page_pool;
+
+	err = mempool_init_kmalloc_pool(&pretty_dev.block_pool.pool, PRETTY_BLOCK_POOL_SIZE,
+					pretty_blocks_size(PRETTY_MAX_BLOCKS, PRETTY_BOUNCE_POOL_PAGES));
+	if (err)
+		goto out_exit_edge_page_pool;
+
+	return 0;
+
+out_exit_edge_page_pool:
+	mempool_exit(&pretty_dev.edge_page_pool.pool);
+out_exit_bounce_page_pool:
+	mempool_exit(&pretty_dev.bounce_page_pool.pool);
+out_exit_crc_page_pool:
+	mempool_exit(&pretty_dev.crc_page_pool.pool);
+out_exit_io_bio_set:
+	bioset_exit(&pretty_dev.io_bio_set);
+out_exit_align_bio_set:
+	bioset_exit(&pretty_dev.align_bio_set);
+out_exit_edge_bio_set:
+	bioset_exit(&pretty_dev.edge_bio_set);
+out_exit_split_bio_set:
+	bioset_exit(&pretty_dev.split_bio_set);
+out_exit_bio_set:
+	bioset_exit(&pretty_dev.bio_set);
+	return err;
+}
+
+static void pretty_mem_exit(void)
+{
+	mempool_exit(&pretty_dev.block_pool.pool);
+	mempool_exit(&pretty_dev.edge_page_pool.pool);
+	mempool_exit(&pretty_dev.bounce_page_pool.pool);
+	mempool_exit(&pretty_dev.crc_page_pool.pool);
+	bioset_exit(&pretty_dev.io_bio_set);
+	bioset_exit(&pretty_dev.align_bio_set);
+	bioset_exit(&pretty_dev.edge_bio_set);
+	bioset_exit(&pretty_dev.split_bio_set);
+	bioset_exit(&pretty_dev.bio_set);
+}
+
+/* all or none of nr elements of a pool, without sleeping */
+static bool pretty_pool_try(struct pretty_pool *pp, void **elements, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		elements[i] = mempool_alloc(&pp->pool, GFP_NOWAIT | __GFP_NOWARN);
+		if (!elements[i])
+			break;
+	}
+	if (i == nr)
+		return true;
+
+	while (i--)
+		mempool_free(elements[i], &pp->pool);
+	return false;
+}
+
+/* Take nr elements of a pool at once. Waiting for a pool while holding part
+ * of it could deadlock, and a worker sleeping on a pool holds one of the
+ * max_workers the bios that would give it back need, so a bio that cannot
+ * get them all right away parks on the pool and runs restart from its
+ * worker again once elements come back, see pretty_pool_put(). Every bio
+ * asks each pool only once, for its worst case, and in the same order:
+ * edge, CRC, block then bounce, so the holders of the elements it waits for
+ * never wait for that pool themselves. Returns false when the bio was
+ * parked, the stage must then return without pretty_io_put().
+ */
+static bool pretty_pool_get(struct pretty_pool *pp, void **elements, unsigned int nr,
+			    struct pretty_bio *pb, void (*restart)(struct pretty_bio *pb))
+{
+	bool got;
+
+	if (pretty_pool_try(pp, elements, nr))
+		return true;
+
+	/* retried under the lock, so that no put goes unnoticed */
+	spin_lock(&pp->lock);
+	got = pretty_pool_try(pp, elements, nr);
+	if (!got) {
+		pb->next = restart;
+		list_add_tail(&pb->wait_node, &pp->waiters);
+	}
+	spin_unlock(&pp->lock);
+
+	return got;
+}
+
+/* give back the elements taken with pretty_pool_get(), NULL ones skipped,
+ * and run again every bio parked on the pool: each retries on its own
+ */
+static void pretty_pool_put(struct pretty_pool *pp, void **elements, unsigned int nr)
+{
+	struct pretty_bio *pb, *tmp;
+	LIST_HEAD(waiters);
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		if (elements[i])
+			mempool_free(elements[i], &pp->pool);
+
+	spin_lock(&pp->lock);
+	list_splice_init(&pp->waiters, &waiters);
+	spin_unlock(&pp->lock);
+
+	list_for_each_entry_safe(pb, tmp, &waiters, wait_node) {
+		list_del(&pb->wait_node);
+		queue_work(pretty_dev.queue, &pb->work);
+	}
+}
+
+/* The per block arrays of a bio in one allocation, from block_pool, which
+ * holds the ones of the largest bio, when kmalloc has nothing. Returns false
+ * when the bio was parked on block_pool, see pretty_pool_get().
+ */
+static bool pretty_alloc_blocks(struct pretty_bio *pb, unsigned int nr_blocks,
+				void (*restart)(struct pretty_bio *pb))
+{
+	unsigned int nr_bounce_pages = DIV_ROUND_UP(nr_blocks, PAGE_SIZE / CSUM_BLOCK_SIZE);
+	size_t size = pretty_blocks_size(nr_blocks, nr_bounce_pages);
+	void *buffer;
+
+	if (pb->checksums)
+		return true;
+
+	buffer = kzalloc(size, GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN);
+	if (!buffer) {
+		if (!pretty_pool_get(&pretty_dev.block_pool, &buffer, 1, pb, restart))
+			return false;
+		memset(buffer, 0, size);
+		pb->blocks_from_pool = true;
+	}
+
+	pb->nr_blocks = nr_blocks;
+	pb->nr_bounce_pages = nr_bounce_pages;
+	pb->checksums = buffer;
+	pb->gather = (u8 *)(pb->checksums + nr_blocks);
+	pb->bounce_pages = (struct page **)(pb->gather + CSUM_BLOCK_SIZE);
+	pb->sector_state = (u8 *)(pb->bounce_pages + nr_bounce_pages);
+	pb->block_repair = pb->sector_state + nr_blocks;
+	return true;
+}
+
+/* The bounce slots of a read, taken when it first checks another leg.
+ * Returns false when the bio was parked, see pretty_pool_get().
+ */
+static bool pretty_get_bounce_pages(struct pretty_bio *pb, void (*restart)(struct pretty_bio *pb))
+{
+	if (pb->bounce_pages[0])
+		return true;
+
+	return pretty_pool_get(&pretty_dev.bounce_page_pool, (void **)pb->bounce_pages,
+			       pb->nr_bounce_pages, pb, restart);
+}
+
+static void pretty_free_blocks(struct pretty_bio *pb)
+{
+	void *buffer = pb->checksums;
+
+	if (!buffer)
+		return;
+
+	if (pb->bounce_pages[0])
+		pretty_pool_put(&pretty_dev.bounce_page_pool, (void **)pb->bounce_pages, pb->nr_bounce_pages);
+
+	pb->checksums = NULL;
+	pb->gather = NULL;
+	pb->bounce_pages = NULL;
+	pb->sector_state = NULL;
+	pb->block_repair = NULL;
+
+	if (pb->blocks_from_pool)
+		pretty_pool_put(&pretty_dev.block_pool, &buffer, 1);
+	else
+		kfree(buffer);
+	pb->blocks_from_pool = false;
+}
+
+/* A discard that failed or a write zeroes the leg turned down leaves the leg
+ * in the array: the CRC slots of the range say zeroes whatever it returns,
+ * see pretty_zero_crc(). Without CRCs the refused write zeroes fails the bio
+ * so that the caller writes the zeroes itself.
+ */
+static bool pretty_io_advisory(struct bio *bio)
+{
+	return bio_op(bio) == REQ_OP_DISCARD ||
+	       (bio_op(bio) == REQ_OP_WRITE_ZEROES && bio->bi_status == BLK_STS_NOTSUPP);
+}
+
+static void pretty_io_endio(struct bio *bio)
+{
+	struct pretty_bio *pb = bio->bi_private;
+	int leg = pretty_leg(bio->bi_disk);
+
+	/* the write is on the other legs, reads are retried on them by the read path */
+	if (bio->bi_status && pretty_io_advisory(bio)) {
+		if (bio_op(bio) == REQ_OP_WRITE_ZEROES && !pretty_dev.csum_size)
+			pb->io_status = bio->bi_status;
+	} else if (bio->bi_status && !(op_is_write(bio_op(bio)) && leg >= 0 && pretty_leg_fail(leg))) {
+		pb->io_status = bio->bi_status;
+	}
+
+	if (leg >= 0)
+		pretty_leg_dec(leg);
+	bio_put(bio);
+	pretty_io_put(pb);
+}
+
+static void __pretty_io_submit(struct pretty_bio *pb, struct bio *bio, bio_end_io_t *end_io)
+{
+	int leg = pretty_leg(bio->bi_disk);
+
+	bio->bi_private = pb;
+	bio->bi_end_io = end_io;
+	atomic_inc(&pb->pending);
+
+	/* not a leg of the array: fail it, the endio finds no leg either */
+	if (WARN_ON_ONCE(leg < 0)) {
+		bio_io_error(bio);
+		return;
+	}
+
+	atomic_inc(&pretty_dev.inflight[leg]);
+	WRITE_ONCE(pretty_dev.head[leg], bio_end_sector(bio));
+
+	submit_bio(bio);
+}
+
+static void pretty_io_submit(struct pretty_bio *pb, struct bio *bio)
+{
+	__pretty_io_submit(pb, bio, pretty_io_endio);
+}
+
+static struct bio *crc_range_bio(struct pretty_bio *pb, struct gendisk *gd, struct page **pages, int dir)
+{
+	struct bio *bio_crc;
+	unsigned int len, i;
+
+	bio_crc = bio_alloc_bioset(GFP_NOIO, pb->nr_crc_pages, &pretty_dev.io_bio_set);	// alloc bio for the whole CRC range
+
+	bio_crc->bi_disk = gd;											// set gendisk
+	bio_crc->bi_opf = dir;											// set operation type
+	bio_crc->bi_iter.bi_sector = pb->first_crc;						// set first CRC sector
+
+	len = (pb->last_crc - pb->first_crc + 1) * KERNEL_SECTOR_SIZE;
+	for (i = 0; i < pb->nr_crc_pages; i++) {
+		bio_add_page(bio_crc, pages[i], min_t(unsigned int, len, PAGE_SIZE), 0);
+		len -= min_t(unsigned int, len, PAGE_SIZE);
+	}
+
+	return bio_crc;
+}
+
+/* read CRC sectors first_crc..last_crc of a disk with a single bio */
+void read_crc_range_from_disk(struct pretty_bio *pb, struct gendisk *gd, struct page **pages)
+{
+	pretty_io_submit(pb, crc_range_bio(pb, gd, pages, REQ_OP_READ));
+}
+
+static void pretty_crc_read_endio(struct bio *bio)
+{
+	struct pretty_bio *pb = bio->bi_private;
+	int leg = pretty_leg(bio->bi_disk);
+
+	if (bio->bi_status)
+		pb->crc_status = bio->bi_status;
+
+	if (leg >= 0)
+		pretty_leg_dec(leg);
+	bio_put(bio);
+	pretty_io_put(pb);
+}
+
+/* read the CRC range of the bio into pb->crc_pages from a leg */
+static void pretty_read_crc_range(struct pretty_bio *pb, int leg)
+{
+	pb->crc_from_disk = true;
+	pb->crc_legs |= BIT(leg);
+	__pretty_io_submit(pb, crc_range_bio(pb, pretty_leg_disk(leg), pb->crc_pages, REQ_OP_READ),
+			   pretty_crc_read_endio);
+}
+
+/* The legs hold the same CRCs, a range that could not be read from one leg
+ * is read again from an active leg not tried yet and the stage that found
+ * the error runs once more. False when the range is loaded or when no leg is
+ * left, pb->crc_status is then still set and the CRCs must not be used.
+ */
+static bool pretty_crc_range_retry(struct pretty_bio *pb)
+{
+	unsigned long untried;
+
+	if (!pb->crc_status)
+		return false;
+
+	untried = READ_ONCE(pretty_dev.active) & ~(unsigned long)pb->crc_legs;
+	if (!untried)
+		return false;
+
+	pb->crc_status = BLK_STS_OK;
+	pretty_read_crc_range(pb, __ffs(untried));
+	pretty_io_put(pb);
+
+	return true;
+}
+
+/* write CRC sectors first_crc..last_crc of a disk with a single bio, FUA with the bio */
+void modify_crc_range_on_disk(struct pretty_bio *pb, struct gendisk *gd, struct page **pages)
+{
+	pretty_io_submit(pb, crc_range_bio(pb, gd, pages, REQ_OP_WRITE | (pb->bio->bi_opf & REQ_FUA)));
+}
+
+/* The CRC ranges and the per block arrays of a bio, taken before its first
+ * I/O: nr_ranges CRC ranges at once, a read needs a second one for the leg
+ * it checks, see pretty_read_start(). What the bio got already is kept, so
+ * restart runs its stage again from the top. Returns false when the bio was
+ * parked, see pretty_pool_get().
+ */
+static bool pretty_reserve(struct pretty_bio *pb, unsigned int nr_ranges, unsigned int nr_blocks,
+			   void (*restart)(struct pretty_bio *pb))
+{
+	if (!pb->nr_crc_pages)
+		return true;
+
+	if (!pb->crc_pages) {
+		if (!pretty_pool_get(&pretty_dev.crc_page_pool, (void **)pb->crc_page_array,
+				     nr_ranges * pb->nr_crc_pages, pb, restart))
+			return false;
+		pb->crc_pages = pb->crc_page_array;
+		if (nr_ranges > 1)
+			pb->crc_pages_secondary = pb->crc_pages + pb->nr_crc_pages;
+	}
+
+	return pretty_alloc_blocks(pb, nr_blocks, restart);
+}
+
+static void free_crc_pages(struct pretty_bio *pb, struct page **pages)
+{
+	if (pages)
+		pretty_pool_put(&pretty_dev.crc_page_pool, (void **)pages, pb->nr_crc_pages);
+}
+
+/* CRC slots are native endian like the original 32-bit format, aligned to their size */
+static u64 get_crc_slot(const char *slot)
+{
+	return pretty_dev.csum_size == sizeof(u64) ? *(const u64 *)slot : *(const u32 *)slot;
+}
+
+static void set_crc_slot(char *slot, u64 checksum)
+{
+	if (pretty_dev.csum_size == sizeof(u64))
+		*(u64 *)slot = checksum;
+	else
+		*(u32 *)slot = checksum;
+}
+
+/* locate the CRC of data_sector inside a range loaded by read_crc_range_from_disk() */
+static char *map_crc_in_range(struct pretty_bio *pb, struct page **pages, unsigned long long data_sector)
+{
+	unsigned long long crc_sector, crc_offset, pos;
+	char *buffer_crc;
+
+	locate_crc_on_disks(data_sector, &crc_sector, &crc_offset);
+	pos = (crc_sector - pb->first_crc) * KERNEL_SECTOR_SIZE + crc_offset;
+
+	buffer_crc = kmap_atomic(pages[pos >> PAGE_SHIFT]);
+
+	return buffer_crc + (pos & (PAGE_SIZE - 1));
+}
+
+static u64 get_crc_from_range(struct pretty_bio *pb, struct page **pages, unsigned long long data_sector)
+{
+	char *crc = map_crc_in_range(pb, pages, data_sector);
+	u64 checksum = get_crc_slot(crc);
+
+	kunmap_atomic(crc);
+
+	return checksum;
+}
+
+static void set_crc_in_range(struct pretty_bio *pb, struct page **pages, unsigned long long data_sector, u64 checksum)
+{
+	char *crc = map_crc_in_range(pb, pages, data_sector);
+
+	set_crc_slot(crc, checksum);
+	kunmap_atomic(crc);
+}
+
+/* set the CRCs of nr adjacent data blocks, their slots follow each other in the range */
+static void set_crcs_in_range(struct pretty_bio *pb, struct page **pages, unsigned long long first_sector,
+			      u64 *checksums, unsigned int nr)
+{
+	unsigned long long crc_sector, crc_offset, pos;
+	char *buffer_crc = NULL;
+	unsigned int k;
+
+	locate_crc_on_disks(first_sector, &crc_sector, &crc_offset);
+	pos = (crc_sector - pb->first_crc) * KERNEL_SECTOR_SIZE + crc_offset;
+
+	for (k = 0; k < nr; k++, pos += pretty_dev.csum_size) {
+		if (!buffer_crc || !(pos & (PAGE_SIZE - 1))) {
+			if (buffer_crc)
+				kunmap_atomic(buffer_crc);
+			buffer_crc = kmap_atomic(pages[pos >> PAGE_SHIFT]);
+		}
+		set_crc_slot(buffer_crc + (pos & (PAGE_SIZE - 1)), checksums[k]);
+	}
+
+	if (buffer_crc)
+		kunmap_atomic(buffer_crc);
+}
+
+/* CRC cache: CRC sectors indexed by crc_sector, kept in LRU order and
+ * bounded by crc_cache_kb. Writes only patch the cached sectors and mark them
+ * dirty, a background work writes the dirty sectors to every leg in sorted,
+ * merged runs. Sectors being written back stay pinned until the write
+ * completes and are dirty again if it failed. Clean sectors are dropped on
+ * LRU order or by the shrinker.
+ *
+ * The cache assumes that nobody writes the CRC area of the disks behind the
+ * driver's back, that is why it is disabled by default.
+ */
+static unsigned int crc_cache_kb;
+static unsigned int crc_cache_writeback_ms = 1000;
+
+#define CRC_CACHE_HASH_BITS		12
+#define CRC_CACHE_WB_BATCH		1024						// CRC sectors written back per pass
+#define CRC_CACHE_WB_PAGES		(CRC_CACHE_WB_BATCH * KERNEL_SECTOR_SIZE / PAGE_SIZE)
+
+struct pretty_crc_entry {
+	struct hlist_node hash_node;
+	struct list_head lru_node;
+	struct list_head dirty_node;
+	unsigned long long crc_sector;
+	bool dirty;
+	bool writing;												// in a write-back in flight, not evicted
+	char data[KERNEL_SECTOR_SIZE];
+};
+
+static struct pretty_crc_cache {
+	spinlock_t lock;
+	struct hlist_head hash[1 << CRC_CACHE_HASH_BITS];
+	struct list_head lru;										// most recently used first
+	struct list_head dirty;
+	unsigned long nr_entries, nr_dirty;
+
+	struct kmem_cache *slab;
+	struct shrinker shrinker;
+
+	/* write-back of the dirty sectors and bios waiting for it */
+	struct workqueue_struct *wb_queue;
+	struct delayed_work writeback;
+	struct list_head waiters;
+	unsigned long wb_requested, wb_done;
+	bool wb_busy;
+	struct pretty_crc_entry *wb_entries[CRC_CACHE_WB_BATCH];	// the batch in flight, see crc_cache_write_dirty()
+
+	atomic_long_t hits, misses, evictions, written;
+} crc_cache;
+
+static unsigned long crc_cache_max_entries(void)
+{
+	return (unsigned long)READ_ONCE(crc_cache_kb) * 1024 / sizeof(struct pretty_crc_entry);
+}
+
+static struct pretty_crc_entry *crc_cache_find(unsigned long long crc_sector)
+{
+	struct pretty_crc_entry *e;
+
+	hlist_for_each_entry(e, &crc_cache.hash[hash_64(crc_sector, CRC_CACHE_HASH_BITS)], hash_node)
+		if (e->crc_sector == crc_sector)
+			return e;
+
+	return NULL;
+}
+
+/* drop clean sectors from the LRU tail until at most target are left, called with the lock held */
+static unsigned long crc_cache_trim(unsigned long nr_to_scan, unsigned long target)
+{
+	struct pretty_crc_entry *e, *tmp;
+	unsigned long freed = 0;
+
+	list_for_each_entry_safe_reverse(e, tmp, &crc_cache.lru, lru_node) {
+		if (crc_cache.nr_entries <= target || !nr_to_scan--)
+			break;
+		if (e->dirty || e->writing)
+			continue;
+
+		hlist_del(&e->hash_node);
+		list_del(&e->lru_node);
+		kmem_cache_free(crc_cache.slab, e);
+		crc_cache.nr_entries--;
+		freed++;
+	}
+
+	atomic_long_add(freed, &crc_cache.evictions);
+
+	return freed;
+}
+
+static void crc_cache_kick(unsigned long delay)
+{
+	if (crc_cache.wb_queue)
+		mod_delayed_work(crc_cache.wb_queue, &crc_cache.writeback, delay);
+}
+
+static char *crc_range_sector(struct page **pages, unsigned long long index)
+{
+	return (char *)page_address(pages[(index * KERNEL_SECTOR_SIZE) >> PAGE_SHIFT]) +
+	       ((index * KERNEL_SECTOR_SIZE) & (PAGE_SIZE - 1));
+}
+
+/* fill the CRC range of the bio from the cache, only if all its sectors are cached */
+static bool crc_cache_load(struct pretty_bio *pb, struct page **pages)
+{
+	struct pretty_crc_entry *e;
+	unsigned long long s;
+	bool all = true;
+
+	spin_lock(&crc_cache.lock);
+	for (s = pb->first_crc; s <= pb->last_crc && all; s++)
+		all = crc_cache_find(s) != NULL;
+
+	if (all) {
+		for (s = pb->first_crc; s <= pb->last_crc; s++) {
+			e = crc_cache_find(s);
+			memcpy(crc_range_sector(pages, s - pb->first_crc), e->data, KERNEL_SECTOR_SIZE);
+			list_move(&e->lru_node, &crc_cache.lru);
+		}
+	}
+	spin_unlock(&crc_cache.lock);
+
+	atomic_long_add(pb->last_crc - pb->first_crc + 1, all ? &crc_cache.hits : &crc_cache.misses);
+
+	return all;
+}
+
+/* put the CRC range of the bio in the cache: dirty sectors are written back later,
+ * clean ones are only added while the budget allows it. Returns false if a dirty
+ * sector could not be cached, in which case the caller writes the range itself.
+ */
+static bool crc_cache_store(struct pretty_bio *pb, struct page **pages, bool dirty)
+{
+	struct pretty_crc_entry *e, *new_entry;
+	unsigned long long s;
+	bool stored = true;
+
+	for (s = pb->first_crc; s <= pb->last_crc; s++) {
+		new_entry = NULL;
+		if (crc_cache_max_entries())
+			new_entry = kmem_cache_alloc(crc_cache.slab, GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN);
+
+		spin_lock(&crc_cache.lock);
+		e = crc_cache_find(s);
+		if (!e && new_entry && crc_cache.nr_entries >= crc_cache_max_entries())
+			crc_cache_trim(ULONG_MAX, crc_cache_max_entries() ? crc_cache_max_entries() - 1 : 0);
+		if (!e && new_entry && (dirty || crc_cache.nr_entries < crc_cache_max_entries())) {
+			e = new_entry;
+			new_entry = NULL;
+			e->crc_sector = s;
+			e->dirty = false;
+			hlist_add_head(&e->hash_node, &crc_cache.hash[hash_64(s, CRC_CACHE_HASH_BITS)]);
+			list_add(&e->lru_node, &crc_cache.lru);
+			crc_cache.nr_entries++;
+		}
+
+		if (e) {
+			memcpy(e->data, crc_range_sector(pages, s - pb->first_crc), KERNEL_SECTOR_SIZE);
+			list_move(&e->lru_node, &crc_cache.lru);
+			if (dirty && !e->dirty) {
+				e->dirty = true;
+				list_add_tail(&e->dirty_node, &crc_cache.dirty);
+				crc_cache.nr_dirty++;
+			}
+		} else if (dirty) {
+			stored = false;
+		}
+		spin_unlock(&crc_cache.lock);
+
+		if (new_entry)
+			kmem_cache_free(crc_cache.slab, new_entry);
+	}
+
+	if (dirty && stored && !delayed_work_pending(&crc_cache.writeback))
+		crc_cache_kick(msecs_to_jiffies(crc_cache_writeback_ms));
+
+	return stored;
+}
+
+/* the range was just read from disk: cached sectors are newer than the disk,
+ * the other ones are added to the cache
+ */
+static void crc_cache_merge(struct pretty_bio *pb, struct page **pages)
+{
+	struct pretty_crc_entry *e;
+	unsigned long long s;
+	bool missing = false;
+
+	spin_lock(&crc_cache.lock);
+	for (s = pb->first_crc; s <= pb->last_crc; s++) {
+		e = crc_cache_find(s);
+		if (e)
+			memcpy(crc_range_sector(pages, s - pb->first_crc), e->data, KERNEL_SECTOR_SIZE);
+		else
+			missing = true;
+	}
+	spin_unlock(&crc_cache.lock);
+
+	if (missing)
+		crc_cache_store(pb, pages, false);
+}
+
+/* run next once every CRC sector dirty at this point is on every leg,
+ * pb->io_status is set if the write-back failed
+ */
+static void crc_cache_sync(struct pretty_bio *pb, void (*next)(struct pretty_bio *pb))
+{
+	pb->next = next;
+
+	spin_lock(&crc_cache.lock);
+	if (!crc_cache.nr_dirty && !crc_cache.wb_busy) {
+		spin_unlock(&crc_cache.lock);
+		next(pb);
+		return;
+	}
+
+	pb->wb_seq = ++crc_cache.wb_requested;
+	list_add_tail(&pb->wait_node, &crc_cache.waiters);
+	spin_unlock(&crc_cache.lock);
+
+	crc_cache_kick(0);
+}
+
+static int crc_entry_cmp(const void *a, const void *b)
+{
+	const struct pretty_crc_entry *ea = *(const struct pretty_crc_entry **)a;
+	const struct pretty_crc_entry *eb = *(const struct pretty_crc_entry **)b;
+
+	if (ea->crc_sector == eb->crc_sector)
+		return 0;
+
+	return ea->crc_sector < eb->crc_sector ? -1 : 1;
+}
+
+struct crc_wb_batch {
+	atomic_t pending;
+	struct completion done;
+	blk_status_t status;
+};
+
+static void crc_wb_endio(struct bio *bio)
+{
+	struct crc_wb_batch *batch = bio->bi_private;
+	int leg = pretty_leg(bio->bi_disk);
+
+	if (bio->bi_status && (WARN_ON_ONCE(leg < 0) || !pretty_leg_fail(leg)))
+		batch->status = bio->bi_status;
+
+	if (leg >= 0)
+		pretty_leg_dec(leg);
+	bio_put(bio);
+	if (atomic_dec_and_test(&batch->pending))
+		complete(&batch->done);
+}
+
+/* the bio goes to the first writable leg, clones of it to the others */
+static void crc_wb_submit(struct crc_wb_batch *batch, struct bio *bio, bool sync)
+{
+	unsigned long legs = pretty_get_writable_legs(), others;
+	struct bio *clone;
+	int leg;
+
+	bio->bi_disk = pretty_leg_disk(__ffs(legs));
+	bio->bi_opf = REQ_OP_WRITE | (sync ? REQ_FUA : 0);
+	bio->bi_private = batch;
+	bio->bi_end_io = crc_wb_endio;
+
+	others = legs & ~BIT(__ffs(legs));
+	atomic_add(hweight_long(others) + 1, &batch->pending);
+
+	/* same pages on the other legs */
+	for_each_set_bit(leg, &others, pretty_dev.nr_legs) {
+		clone = bio_clone_fast(bio, GFP_NOIO, &pretty_dev.io_bio_set);
+		clone->bi_disk = pretty_leg_disk(leg);
+		clone->bi_private = batch;
+		clone->bi_end_io = crc_wb_endio;
+		atomic_inc(&pretty_dev.inflight[leg]);
+		submit_bio(clone);
+	}
+
+	atomic_inc(&pretty_dev.inflight[__ffs(legs)]);
+	submit_bio(bio);
+	pretty_put_legs(legs);
+}
+
+/* write one batch of dirty sectors, returns false when nothing was dirty.
+ * The pages come from the CRC page reserve: only the first one is waited
+ * for, the batch is cut to the ones available right away.
+ */
+static bool crc_cache_write_dirty(bool sync, blk_status_t *status)
+{
+	struct pretty_crc_entry **entries = crc_cache.wb_entries, *e;
+	struct page *pages[CRC_CACHE_WB_PAGES];
+	struct crc_wb_batch batch;
+	struct bio *bio = NULL;
+	unsigned long nr = 0, i, nr_pages;
+	struct page *page;
+	unsigned int offset;
+
+	if (!READ_ONCE(crc_cache.nr_dirty))
+		return false;
+
+	nr_pages = DIV_ROUND_UP(min_t(unsigned long, READ_ONCE(crc_cache.nr_dirty), CRC_CACHE_WB_BATCH) * KERNEL_SECTOR_SIZE, PAGE_SIZE);
+	pages[0] = mempool_alloc(&pretty_dev.crc_page_pool.pool, GFP_NOIO);
+	for (i = 1; i < nr_pages; i++) {
+		pages[i] = mempool_alloc(&pretty_dev.crc_page_pool.pool, GFP_NOWAIT | __GFP_NOWARN);
+		if (!pages[i])
+			break;
+	}
+	nr_pages = i;
+
+	/* snapshot the dirty sectors, they become clean and pinned right away
+	 * and a write coming in meanwhile dirties them again
+	 */
+	spin_lock(&crc_cache.lock);
+	list_for_each_entry(e, &crc_cache.dirty, dirty_node) {
+		if (nr == nr_pages * (PAGE_SIZE / KERNEL_SECTOR_SIZE))
+			break;
+		entries[nr++] = e;
+	}
+	sort(entries, nr, sizeof(*entries), crc_entry_cmp, NULL);
+	for (i = 0; i < nr; i++) {
+		e = entries[i];
+		memcpy(crc_range_sector(pages, i), e->data, KERNEL_SECTOR_SIZE);
+		list_del_init(&e->dirty_node);
+		e->dirty = false;
+		e->writing = true;
+	}
+	crc_cache.nr_dirty -= nr;
+	spin_unlock(&crc_cache.lock);
+
+	atomic_set(&batch.pending, 1);
+	init_completion(&batch.done);
+	batch.status = BLK_STS_OK;
+
+	/* merge adjacent CRC sectors in a single bio */
+	for (i = 0; i < nr; i++) {
+		page = pages[i / (PAGE_SIZE / KERNEL_SECTOR_SIZE)];
+		offset = (i * KERNEL_SECTOR_SIZE) & (PAGE_SIZE - 1);
+
+		if (bio && (bio_end_sector(bio) != entries[i]->crc_sector ||
+			    bio_add_page(bio, page, KERNEL_SECTOR_SIZE, offset) != KERNEL_SECTOR_SIZE)) {
+			crc_wb_submit(&batch, bio, sync);
+			bio = NULL;
+		}
+
+		if (!bio) {
+			bio = bio_alloc_bioset(GFP_NOIO, BIO_MAX_PAGES, &pretty_dev.io_bio_set);
+			bio->bi_iter.bi_sector = entries[i]->crc_sector;
+			bio_add_page(bio, page, KERNEL_SECTOR_SIZE, offset);
+		}
+	}
+	if (bio)
+		crc_wb_submit(&batch, bio, sync);
+
+	if (!atomic_dec_and_test(&batch.pending))
+		wait_for_completion(&batch.done);
+
+	/* unpin the batch, a failed write leaves it dirty for the next pass */
+	spin_lock(&crc_cache.lock);
+	for (i = 0; i < nr; i++) {
+		e = entries[i];
+		e->writing = false;
+		if (batch.status && !e->dirty) {
+			e->dirty = true;
+			list_add_tail(&e->dirty_node, &crc_cache.dirty);
+			crc_cache.nr_dirty++;
+		}
+	}
+	spin_unlock(&crc_cache.lock);
+
+	if (batch.status) {
+		pr_err_ratelimited("CRC cache: write-back of %lu sectors failed\n", nr);
+		*status = batch.status;
+	} else {
+		atomic_long_add(nr, &crc_cache.written);
+	}
+
+	pretty_pool_put(&pretty_dev.crc_page_pool, (void **)pages, nr_pages);
+
+	return nr > 0;
+}
+
+static void crc_cache_writeback(struct work_struct *work)
+{
+	blk_status_t status = BLK_STS_OK;
+	struct pretty_bio *pb, *tmp;
+	unsigned long target;
+	bool sync;
+
+	spin_lock(&crc_cache.lock);
+	target = crc_cache.wb_requested;
+	sync = !list_empty(&crc_cache.waiters);
+	crc_cache.wb_busy = true;
+	spin_unlock(&crc_cache.lock);
+
+	while (!status && crc_cache_write_dirty(sync, &status))
+		;
+
+	spin_lock(&crc_cache.lock);
+	crc_cache.wb_busy = false;
+	crc_cache.wb_done = target;
+	list_for_each_entry_safe(pb, tmp, &crc_cache.waiters, wait_node) {
+		if (pb->wb_seq > target)
+			continue;
+		list_del(&pb->wait_node);
+		if (status)
+			pb->io_status = status;
+		queue_work(pretty_dev.queue, &pb->work);
+	}
+	crc_cache_trim(ULONG_MAX, crc_cache_max_entries());
+	spin_unlock(&crc_cache.lock);
+
+	/* a bio asked for a sync while this pass was running, or the sectors
+	 * left dirty by a failed write are tried again later
+	 */
+	if (READ_ONCE(crc_cache.wb_requested) != target)
+		crc_cache_kick(0);
+	else if (status)
+		crc_cache_kick(msecs_to_jiffies(crc_cache_writeback_ms));
+}
+
+/* every sector dirty at this point is written back when this returns, on success */
+static void crc_cache_flush(void)
+{
+	if (!crc_cache.wb_queue)
+		return;
+
+	mod_delayed_work(crc_cache.wb_queue, &crc_cache.writeback, 0);
+	flush_delayed_work(&crc_cache.writeback);
+}
+
+/* call fn with the data sectors of every CRC sector not on the legs yet */
+static void crc_cache_for_each_unwritten(void (*fn)(unsigned long long sector, unsigned int nr_sectors))
+{
+	struct pretty_crc_entry *e;
+
+	if (!pretty_dev.csum_size)
+		return;
+
+	spin_lock(&crc_cache.lock);
+	list_for_each_entry(e, &crc_cache.lru, lru_node)
+		if (e->dirty || e->writing)
+			fn((e->crc_sector - pretty_dev.data_sectors) * DATA_SECTORS_PER_CRC_SECTOR,
+			   DATA_SECTORS_PER_CRC_SECTOR);
+	spin_unlock(&crc_cache.lock);
+}
+
+static unsigned long crc_cache_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	return READ_ONCE(crc_cache.nr_entries) - READ_ONCE(crc_cache.nr_dirty);
+}
+
+static unsigned long crc_cache_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	unsigned long freed;
+
+	spin_lock(&crc_cache.lock);
+	freed = crc_cache_trim(sc->nr_to_scan, 0);
+	spin_unlock(&crc_cache.lock);
+
+	return freed;
+}
+
+static int crc_cache_init(void)
+{
+	int i;
+
+	spin_lock_init(&crc_cache.lock);
+	for (i = 0; i < (1 << CRC_CACHE_HASH_BITS); i++)
+		INIT_HLIST_HEAD(&crc_cache.hash[i]);
+	INIT_LIST_HEAD(&crc_cache.lru);
+	INIT_LIST_HEAD(&crc_cache.dirty);
+	INIT_LIST_HEAD(&crc_cache.waiters);
+	INIT_DELAYED_WORK(&crc_cache.writeback, crc_cache_writeback);
+
+	crc_cache.slab = KMEM_CACHE(pretty_crc_entry, 0);
+	if (!crc_cache.slab)
+		return -ENOMEM;
+
+	crc_cache.wb_queue = alloc_workqueue("pretty_crc_wb", WQ_MEM_RECLAIM, 1);
+	if (!crc_cache.wb_queue)
+		goto out_destroy_slab;
+
+	crc_cache.shrinker.count_objects = crc_cache_count;
+	crc_cache.shrinker.scan_objects = crc_cache_scan;
+	crc_cache.shrinker.seeks = DEFAULT_SEEKS;
+	if (register_shrinker(&crc_cache.shrinker))
+		goto out_destroy_queue;
+
+	return 0;
+
+out_destroy_queue:
+	destroy_workqueue(crc_cache.wb_queue);
+	crc_cache.wb_queue = NULL;
+out_destroy_slab:
+	kmem_cache_destroy(crc_cache.slab);
+	return -ENOMEM;
+}
+
+/* false when dirty sectors could not be written */
+static bool crc_cache_exit(void)
+{
+	blk_status_t status = BLK_STS_OK;
+	struct pretty_crc_entry *e, *tmp;
+
+	unregister_shrinker(&crc_cache.shrinker);
+
+	/* write the last dirty sectors and empty the cache */
+	cancel_delayed_work_sync(&crc_cache.writeback);
+	while (!status && crc_cache_write_dirty(true, &status))
+		;
+	destroy_workqueue(crc_cache.wb_queue);
+	crc_cache.wb_queue = NULL;
+
+	spin_lock(&crc_cache.lock);
+	if (status)
+		pr_err("CRC cache: %lu dirty sectors lost\n", crc_cache.nr_dirty);
+	list_for_each_entry_safe(e, tmp, &crc_cache.dirty, dirty_node) {
+		list_del_init(&e->dirty_node);
+		e->dirty = false;
+	}
+	crc_cache.nr_dirty = 0;
+	crc_cache_trim(ULONG_MAX, 0);
+	spin_unlock(&crc_cache.lock);
+
+	kmem_cache_destroy(crc_cache.slab);
+
+	return !status;
+}
+
+static int crc_cache_kb_set(const char *val, const struct kernel_param *kp)
+{
+	int err = param_set_uint(val, kp);
+
+	/* a smaller budget is applied at the end of the next write-back */
+	if (!err)
+		crc_cache_kick(0);
+
+	return err;
+}
+
+static const struct kernel_param_ops crc_cache_kb_ops = {
+	.set = crc_cache_kb_set,
+	.get = param_get_uint,
+};
+
+static int param_get_counter(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%ld\n", atomic_long_read((atomic_long_t *)kp->arg));
+}
+
+static const struct kernel_param_ops pretty_counter_ops = {
+	.get = param_get_counter,
+};
+
+module_param_cb(crc_cache_kb, &crc_cache_kb_ops, &crc_cache_kb, 0644);
+MODULE_PARM_DESC(crc_cache_kb, "Memory budget of the CRC cache in KiB, 0 disables it (default 0)");
+module_param(crc_cache_writeback_ms, uint, 0644);
+MODULE_PARM_DESC(crc_cache_writeback_ms, "Delay before dirty CRC sectors are written back (default 1000)");
+module_param_cb(crc_cache_hits, &pretty_counter_ops, &crc_cache.hits, 0444);
+module_param_cb(crc_cache_misses, &pretty_counter_ops, &crc_cache.misses, 0444);
+module_param_cb(crc_cache_evictions, &pretty_counter_ops, &crc_cache.evictions, 0444);
+module_param_cb(crc_cache_written, &pretty_counter_ops, &crc_cache.written, 0444);
+
+/* Checksums: every on-disk algorithm has one or more implementations, the
+ * fastest one on this machine is picked at load time, the way raid6 and xor
+ * pick theirs. The crypto API ones use the CPU instructions when available
+ * (SSE4.2/PCLMULQDQ, arm64 CRC), the library ones are the table driven
+ * slice-by-8 code.
+ */
+struct pretty_csum_impl {
+	const char *name;
+	u32 alg;
+	const char *shash;											// crypto API algorithm, NULL for a library one
+	u64 (*sum)(struct pretty_csum_impl *impl, const void *data, unsigned int len);
+	/* checksums of nr adjacent buffers of len bytes */
+	void (*sum_many)(struct pretty_csum_impl *impl, const u8 *data, unsigned int len, unsigned int nr, u64 *out);
+	struct crypto_shash *tfm;
+};
+
+#define CSUM_BENCH_US		2000
+
+static const char * const csum_alg_names[] = {
+	[SSR_CSUM_CRC32] = "crc32",
+	[SSR_CSUM_CRC32C] = "crc32c",
+	[SSR_CSUM_XXHASH64] = "xxhash64",
+	[SSR_CSUM_NONE] = "none",
+};
+
+/* bytes of a CRC slot in the CRC area */
+static const unsigned int csum_sizes[] = {
+	[SSR_CSUM_CRC32] = sizeof(u32),
+	[SSR_CSUM_CRC32C] = sizeof(u32),
+	[SSR_CSUM_XXHASH64] = sizeof(u64),
+	[SSR_CSUM_NONE] = 0,
+};
+
+static u64 csum_crc32_lib(struct pretty_csum_impl *impl, const void *data, unsigned int len)
+{
+	return crc32(0, data, len);
+}
+
+static u64 csum_crc32c_lib(struct pretty_csum_impl *impl, const void *data, unsigned int len)
+{
+	return ~__crc32c_le(~0, data, len);
+}
+
+static u64 csum_xxh64_lib(struct pretty_csum_impl *impl, const void *data, unsigned int len)
+{
+	return xxh64(data, len, 0);
+}
+
+/* the crypto API crc32 and crc32c digests are the little-endian CRC, seeded and
+ * finalized the same way as the library functions above, xxhash64 is the
+ * little-endian hash with the default seed 0
+ */
+static u64 csum_shash(struct pretty_csum_impl *impl, const void *data, unsigned int len)
+{
+	SHASH_DESC_ON_STACK(desc, impl->tfm);
+	u8 digest[sizeof(u64)];
+
+	desc->tfm = impl->tfm;
+	crypto_shash_digest(desc, data, len, digest);
+
+	if (crypto_shash_digestsize(impl->tfm) == sizeof(u64))
+		return get_unaligned_le64(digest);
+	return get_unaligned_le32(digest);
+}
+
+static void csum_many(struct pretty_csum_impl *impl, const u8 *data, unsigned int len, unsigned int nr, u64 *out)
+{
+	unsigned int k;
+
+	for (k = 0; k < nr; k++)
+		out[k] = impl->sum(impl, data + k * len, len);
+}
+
+/* Table driven slice-by-8 CRC that runs four buffers in lockstep: the four
+ * dependency chains are independent, so the CPU overlaps their table lookups
+ * instead of waiting on a single chain. crc32 is seeded with 0 as the
+ * original format, crc32c with ~0 and inverted at the end.
+ */
+static u32 csum_tables[SSR_CSUM_CRC32C + 1][8][256];
+
+static const u32 csum_polys[SSR_CSUM_CRC32C + 1] = {
+	[SSR_CSUM_CRC32] = 0xedb88320,
+	[SSR_CSUM_CRC32C] = 0x82f63b78,
+};
+
+static u32 csum_seed(u32 alg)
+{
+	return alg == SSR_CSUM_CRC32C ? ~0 : 0;
+}
+
+static void csum_tables_init(u32 alg)
+{
+	u32 (*t)[256] = csum_tables[alg];
+	u32 crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (csum_polys[alg] & -(crc & 1));
+		t[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			t[j][i] = (t[j - 1][i] >> 8) ^ t[0][t[j - 1][i] & 0xff];
+}
+
+#define CSUM_SLICE8(t, crc, p) ({									\
+	u32 __lo = get_unaligned_le32(p) ^ (crc), __hi = get_unaligned_le32((p) + 4);		\
+	(t)[7][__lo & 0xff] ^ (t)[6][(__lo >> 8) & 0xff] ^ (t)[5][(__lo >> 16) & 0xff] ^	\
+	(t)[4][__lo >> 24] ^ (t)[3][__hi & 0xff] ^ (t)[2][(__hi >> 8) & 0xff] ^		\
+	(t)[1][(__hi >> 16) & 0xff] ^ (t)[0][__hi >> 24];					\
+})
+
+static u64 csum_table(struct pretty_csum_impl *impl, const void *data, unsigned int len)
+{
+	u32 (*t)[256] = csum_tables[impl->alg];
+	u32 crc = csum_seed(impl->alg);
+	const u8 *p = data;
+
+	for (; len >= 8; len -= 8, p += 8)
+		crc = CSUM_SLICE8(t, crc, p);
+	for (; len; len--, p++)
+		crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+
+	return crc ^ csum_seed(impl->alg);
+}
+
+static void csum_table_x4(struct pretty_csum_impl *impl, const u8 *data, unsigned int len, unsigned int nr, u64 *out)
+{
+	u32 (*t)[256] = csum_tables[impl->alg];
+	u32 seed = csum_seed(impl->alg);
+	u32 c0, c1, c2, c3;
+	unsigned int pos;
+
+	/* the buffers are whole sectors, a multiple of 8 bytes */
+	for (; nr >= 4; nr -= 4, data += 4 * len, out += 4) {
+		c0 = c1 = c2 = c3 = seed;
+		for (pos = 0; pos < len; pos += 8) {
+			c0 = CSUM_SLICE8(t, c0, data + pos);
+			c1 = CSUM_SLICE8(t, c1, data + len + pos);
+			c2 = CSUM_SLICE8(t, c2, data + 2 * len + pos);
+			c3 = CSUM_SLICE8(t, c3, data + 3 * len + pos);
+		}
+		out[0] = c0 ^ seed;
+		out[1] = c1 ^ seed;
+		out[2] = c2 ^ seed;
+		out[3] = c3 ^ seed;
+	}
+
+	csum_many(impl, data, len, nr, out);
+}
+
+static struct pretty_csum_impl csum_impls[] = {
+	{ .name = "crc32_le", .alg = SSR_CSUM_CRC32, .sum = csum_crc32_lib, .sum_many = csum_many },
+	{ .name = "crc32-slice8x4", .alg = SSR_CSUM_CRC32, .sum = csum_table, .sum_many = csum_table_x4 },
+	{ .alg = SSR_CSUM_CRC32, .shash = "crc32", .sum = csum_shash, .sum_many = csum_many },
+	{ .name = "__crc32c_le", .alg = SSR_CSUM_CRC32C, .sum = csum_crc32c_lib, .sum_many = csum_many },
+	{ .name = "crc32c-slice8x4", .alg = SSR_CSUM_CRC32C, .sum = csum_table, .sum_many = csum_table_x4 },
+	{ .alg = SSR_CSUM_CRC32C, .shash = "crc32c", .sum = csum_shash, .sum_many = csum_many },
+	{ .name = "xxh64", .alg = SSR_CSUM_XXHASH64, .sum = csum_xxh64_lib, .sum_many = csum_many },
+	{ .alg = SSR_CSUM_XXHASH64, .shash = "xxhash64", .sum = csum_shash, .sum_many = csum_many },
+};
+
+static struct pretty_csum_impl *csum_impl;
+
+/* MB/s of an implementation over a page of checksum blocks, the way the I/O path calls it */
+static u64 csum_benchmark(struct pretty_csum_impl *impl, const char *buffer)
+{
+	u64 out[PAGE_SIZE / KERNEL_SECTOR_SIZE];
+	ktime_t start = ktime_get();
+	u64 bytes = 0;
+	s64 ns;
+
+	do {
+		impl->sum_many(impl, (const u8 *)buffer, CSUM_BLOCK_SIZE, PAGE_SIZE / CSUM_BLOCK_SIZE, out);
+		bytes += PAGE_SIZE;
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	} while (ns < CSUM_BENCH_US * NSEC_PER_USEC);
+
+	return div64_u64(bytes * 1000, ns);
+}
+
+static int pretty_csum_init(u32 alg)
+{
+	struct pretty_csum_impl *impl;
+	u64 speed, best = 0;
+	char *buffer;
+
+	if (alg == SSR_CSUM_NONE) {
+		pr_info("checksum: none, plain mirror\n");
+		return 0;
+	}
+
+	buffer = (char *)__get_free_page(GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+	get_random_bytes(buffer, PAGE_SIZE);
+
+	if (alg < ARRAY_SIZE(csum_polys))
+		csum_tables_init(alg);
+
+	for (impl = csum_impls; impl < csum_impls + ARRAY_SIZE(csum_impls); impl++) {
+		if (impl->alg != alg)
+			continue;
+
+		if (impl->shash) {
+			impl->tfm = crypto_alloc_shash(impl->shash, 0, 0);
+			if (IS_ERR(impl->tfm)) {
+				impl->tfm = NULL;
+				continue;
+			}
+			impl->name = crypto_shash_driver_name(impl->tfm);
+		}
+
+		speed = csum_benchmark(impl, buffer);
+		pr_info("checksum: %-16s %6llu MB/s\n", impl->name, speed);
+		if (speed > best) {
+			best = speed;
+			csum_impl = impl;
+		}
+	}
+
+	free_page((unsigned long)buffer);
+
+	if (!csum_impl) {
+		pr_err("checksum: no implementation of %s\n", csum_alg_names[alg]);
+		return -ENOENT;
+	}
+
+	pr_info("checksum: using %s for %s (%llu.%03llu GB/s)\n", csum_impl->name, csum_alg_names[alg],
+		best / 1000, best % 1000);
+
+	pretty_dev.zero_csum = csum_impl->sum(csum_impl, page_address(ZERO_PAGE(0)), CSUM_BLOCK_SIZE);
+
+	spin_lock_init(&pretty_dev.zeroed_lock);
+	pretty_dev.zeroed = kvzalloc(BITS_TO_LONGS(CRC_AREA_END - pretty_dev.data_sectors) * sizeof(unsigned long),
+				     GFP_KERNEL);
+	if (!pretty_dev.zeroed)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void pretty_csum_exit(void)
+{
+	struct pretty_csum_impl *impl;
+
+	kvfree(pretty_dev.zeroed);
+	pretty_dev.zeroed = NULL;
+
+	for (impl = csum_impls; impl < csum_impls + ARRAY_SIZE(csum_impls); impl++) {
+		if (impl->tfm)
+			crypto_free_shash(impl->tfm);
+		impl->tfm = NULL;
+	}
+}
+
+u64 compute_crc(struct page *page, int len)
+{
+	u64 checksum;
+	char *buffer_data;
+
+	buffer_data = kmap_atomic(page);
+	checksum = csum_impl->sum(csum_impl, buffer_data + len, CSUM_BLOCK_SIZE);
+
+	kunmap_atomic(buffer_data);
+
+	return checksum;
+}
+
+/* checksums of all the blocks of a bio in one pass, each page is mapped once;
+ * a block split across segments is gathered in gather, CSUM_BLOCK_SIZE bytes, first
+ */
+static void compute_crc_bio(struct bio *bio, u64 *checksums, u8 *gather)
+{
+	unsigned int block_size = CSUM_BLOCK_SIZE, len, nr, fill = 0;
+	struct bio_vec bvec;
+	struct bvec_iter i;
+	char *buffer_data;
+	u8 *p;
+
+	bio_for_each_segment(bvec, bio, i) {
+		buffer_data = kmap_atomic(bvec.bv_page);
+		p = (u8 *)buffer_data + bvec.bv_offset;
+		len = bvec.bv_len;
+
+		if (fill) {
+			nr = min(len, block_size - fill);
+			memcpy(gather + fill, p, nr);
+			fill += nr;
+			p += nr;
+			len -= nr;
+
+			if (fill == block_size) {
+				*checksums++ = csum_impl->sum(csum_impl, gather, block_size);
+				fill = 0;
+			}
+		}
+
+		nr = len / block_size;
+		csum_impl->sum_many(csum_impl, p, block_size, nr, checksums);
+		checksums += nr;
+		p += nr * block_size;
+		len -= nr * block_size;
+
+		if (len) {
+			memcpy(gather, p, len);
+			fill = len;
+		}
+
+		kunmap_atomic(buffer_data);
+	}
+}
+
+/* Microbenchmark of the checksum of a 1 MiB bio: one compute_crc() per block
+ * against compute_crc_bio(). Writing anything to the csum_bench parameter runs
+ * it and logs both results.
+ */
+static int csum_bench_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int k, per_page = PAGE_SIZE / CSUM_BLOCK_SIZE, nr = BIO_MAX_PAGES * per_page;
+	struct bio *bio;
+	struct page *page;
+	u64 *checksums, per_block, batched;
+	u8 *gather;
+	ktime_t start;
+	int err = 0;
+
+	if (!csum_impl)
+		return -ENODEV;
+
+	checksums = kmalloc_array(nr, sizeof(*checksums), GFP_KERNEL);
+	gather = kmalloc(CSUM_BLOCK_SIZE, GFP_KERNEL);
+	bio = bio_alloc(GFP_KERNEL, BIO_MAX_PAGES);
+	if (!checksums || !gather || !bio) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (k = 0; k < BIO_MAX_PAGES; k++) {
+		page = alloc_page(GFP_KERNEL);
+		if (!page) {
+			err = -ENOMEM;
+			goto out;
+		}
+		get_random_bytes(page_address(page), PAGE_SIZE);
+		bio_add_page(bio, page, PAGE_SIZE, 0);
+	}
+
+	start = ktime_get();
+	for (k = 0; k < nr; k++)
+		checksums[k] = compute_crc(bio->bi_io_vec[k / per_page].bv_page, (k % per_page) * CSUM_BLOCK_SIZE);
+	per_block = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	compute_crc_bio(bio, checksums, gather);
+	batched = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	pr_info("checksum: %s on 1 MiB, per block %llu ns, batched %llu ns\n", csum_impl->name, per_block, batched);
+
+out:
+	if (bio) {
+		for (k = 0; k < bio->bi_vcnt; k++)
+			__free_page(bio->bi_io_vec[k].bv_page);
+		bio_put(bio);
+	}
+	kfree(gather);
+	kfree(checksums);
+
+	return err;
+}
+
+static const struct kernel_param_ops csum_bench_ops = {
+	.set = csum_bench_set,
+};
+
+module_param_cb(csum_bench, &csum_bench_ops, NULL, 0200);
+MODULE_PARM_DESC(csum_bench, "Write to run the checksum microbenchmark");
+
+void retransmit_bio_data_on_disk(struct pretty_bio *pb, struct gendisk *gd, struct bio *my_bio)
+{
+	struct bio *new_bio;
+
+	/* the clone shares the bvecs of the original bio, no data is copied:
+	 * a write sends the pages of the bio, a read fills them
+	 */
+	new_bio = bio_clone_fast(my_bio, GFP_NOIO, &pretty_dev.io_bio_set);
+	new_bio->bi_disk = gd;											// set gendisk
+
+	pretty_io_submit(pb, new_bio);
+}
+
+/* Two bios conflict when they touch the same CRC sector: a write does a
+ * read-modify-write of the whole CRC sector and a read may repair it, so they
+ * must not interleave. Every bio goes in an interval tree of CRC ranges and
+ * counts the overlapping bios that arrived before it, it owns its range when
+ * that count drops to 0. Bios that do not overlap never wait for each other.
+ */
+#define RANGE_START(pb)		((pb)->first_crc)
+#define RANGE_LAST(pb)		((pb)->last_crc)
+
+INTERVAL_TREE_DEFINE(struct pretty_bio, range_rb, unsigned long long, range_subtree_last,
+		     RANGE_START, RANGE_LAST, static, pretty_range_tree)
+
+static bool pretty_range_lock(struct pretty_bio *pb)
+{
+	struct pretty_bio *other;
+
+	spin_lock(&pretty_dev.range_lock);
+	pb->range_seq = ++pretty_dev.range_seq;
+	pb->range_blockers = 0;
+	for (other = pretty_range_tree_iter_first(&pretty_dev.range_tree, pb->first_crc, pb->last_crc); other;
+	     other = pretty_range_tree_iter_next(other, pb->first_crc, pb->last_crc))
+		pb->range_blockers++;
+
+	pretty_range_tree_insert(pb, &pretty_dev.range_tree);
+	pb->locked = !pb->range_blockers;
+	spin_unlock(&pretty_dev.range_lock);
+
+	return pb->locked;
+}
+
+static void pretty_range_unlock(struct pretty_bio *pb)
+{
+	struct pretty_bio *waiter;
+
+	spin_lock(&pretty_dev.range_lock);
+	pretty_range_tree_remove(pb, &pretty_dev.range_tree);
+
+	/* only the bios that came after this one counted it */
+	for (waiter = pretty_range_tree_iter_first(&pretty_dev.range_tree, pb->first_crc, pb->last_crc); waiter;
+	     waiter = pretty_range_tree_iter_next(waiter, pb->first_crc, pb->last_crc)) {
+		if (waiter->range_seq < pb->range_seq || --waiter->range_blockers)
+			continue;
+
+		waiter->locked = true;
+		queue_work(pretty_dev.queue, &waiter->work);
+	}
+	spin_unlock(&pretty_dev.range_lock);
+}
+
+/* with the blk-mq front end every bio of a request runs as its own pretty_bio,
+ * the request completes with the last of them
+ */
+struct pretty_rq {
+	atomic_t pending;
+	blk_status_t status;
+};
+
+static void pretty_rq_put(struct request *rq, blk_status_t status)
+{
+	struct pretty_rq *prq = blk_mq_rq_to_pdu(rq);
+
+	if (status)
+		prq->status = status;
+
+	if (atomic_dec_and_test(&prq->pending))
+		blk_mq_end_request(rq, prq->status);
+}
+
+/* Checksum blocks larger than a sector: a bio that starts or ends inside a
+ * block runs as a block aligned copy, which shares the pages of the bio for
+ * the whole blocks and has a bounce page for each partial block at the edges.
+ * A read gets the whole edge blocks verified and copies the requested part
+ * when it completes, a write reads and verifies the edge blocks first and
+ * merges its data in them, see pretty_write_start().
+ */
+static void copy_bio_data(struct bio *bio, unsigned int offset, char *buffer, unsigned int len, bool to_bio)
+{
+	struct bvec_iter iter = bio->bi_iter;
+	struct bio_vec bvec;
+	char *buffer_data;
+
+	bio_advance_iter(bio, &iter, offset);
+	while (len) {
+		bvec = bio_iter_iovec(bio, iter);
+		bvec.bv_len = min(bvec.bv_len, len);
+
+		buffer_data = kmap_atomic(bvec.bv_page);
+		if (to_bio)
+			memcpy(buffer_data + bvec.bv_offset, buffer, bvec.bv_len);
+		else
+			memcpy(buffer, buffer_data + bvec.bv_offset, bvec.bv_len);
+		kunmap_atomic(buffer_data);
+
+		bio_advance_iter(bio, &iter, bvec.bv_len);
+		buffer += bvec.bv_len;
+		len -= bvec.bv_len;
+	}
+}
+
+/* Returns false when the bio was parked on edge_page_pool, see pretty_pool_get().
+ * A bio parked later on is block aligned by then and keeps its copy.
+ */
+static bool pretty_align_bio(struct pretty_bio *pb, void (*restart)(struct pretty_bio *pb))
+{
+	struct bio *bio = pb->bio, *aligned;
+	unsigned long long start = bio->bi_iter.bi_sector, end = bio_end_sector(bio);
+	unsigned long long head = round_down(start, CSUM_BLOCK_SECTORS), tail = round_down(end, CSUM_BLOCK_SECTORS);
+	unsigned long long first = round_up(start, CSUM_BLOCK_SECTORS);
+	struct page *edges[2];
+	bool head_edge, tail_edge;
+	struct bvec_iter iter;
+	struct bio_vec bvec;
+
+	if (!bio->bi_iter.bi_size || (start == head && end == tail))
+		return true;
+
+	/* the second edge unless the bio ends in the block it starts in */
+	head_edge = start != head;
+	tail_edge = end != tail && (start == head || tail != head);
+	if (!pretty_pool_get(&pretty_dev.edge_page_pool, (void **)edges, head_edge + tail_edge, pb, restart))
+		return false;
+
+	/* at most BIO_MAX_PAGES: the queue limits keep bios far below BIO_MAX_PAGES - 2
+	 * segments and pretty_write_zeroes_slow() cuts its own bios there
+	 */
+	aligned = bio_alloc_bioset(GFP_NOIO, bio_segments(bio) + 2, &pretty_dev.align_bio_set);
+	aligned->bi_disk = bio->bi_disk;
+	aligned->bi_opf = bio->bi_opf;
+	aligned->bi_iter.bi_sector = head;
+
+	if (head_edge) {
+		pb->edge_pages[0] = edges[0];
+		bio_add_page(aligned, pb->edge_pages[0], CSUM_BLOCK_SIZE, 0);
+	}
+
+	/* the whole blocks in between come straight from the pages of the bio */
+	if (tail > first) {
+		iter = bio->bi_iter;
+		bio_advance_iter(bio, &iter, (first - start) * KERNEL_SECTOR_SIZE);
+		iter.bi_size = (tail - first) * KERNEL_SECTOR_SIZE;
+		__bio_for_each_segment(bvec, bio, iter, iter)
+			bio_add_page(aligned, bvec.bv_page, bvec.bv_len, bvec.bv_offset);
+	}
+
+	if (tail_edge) {
+		pb->edge_pages[1] = edges[head_edge];
+		bio_add_page(aligned, pb->edge_pages[1], CSUM_BLOCK_SIZE, 0);
+	}
+
+	pb->orig_bio = bio;
+	pb->bio = aligned;
+	return true;
+}
+
+/* copy the part of the edge blocks covered by the original bio, to or from it */
+static void copy_edges(struct pretty_bio *pb, bool to_bio)
+{
+	struct bio *bio = pb->orig_bio;
+	unsigned long long start = bio->bi_iter.bi_sector, end = bio_end_sector(bio);
+	unsigned long long head = round_down(start, CSUM_BLOCK_SECTORS), tail = round_down(end, CSUM_BLOCK_SECTORS);
+
+	if (pb->edge_pages[0])
+		copy_bio_data(bio, 0, (char *)page_address(pb->edge_pages[0]) + (start - head) * KERNEL_SECTOR_SIZE,
+			      (min(end, head + CSUM_BLOCK_SECTORS) - start) * KERNEL_SECTOR_SIZE, to_bio);
+	if (pb->edge_pages[1])
+		copy_bio_data(bio, (tail - start) * KERNEL_SECTOR_SIZE, page_address(pb->edge_pages[1]),
+			      (end - tail) * KERNEL_SECTOR_SIZE, to_bio);
+}
+
+static void pretty_unalign_bio(struct pretty_bio *pb)
+{
+	if (!pb->orig_bio)
+		return;
+
+	if (bio_data_dir(pb->orig_bio) != REQ_OP_WRITE && pb->err != 1)
+		copy_edges(pb, true);
+
+	bio_put(pb->bio);
+	pretty_pool_put(&pretty_dev.edge_page_pool, (void **)pb->edge_pages, ARRAY_SIZE(pb->edge_pages));
+
+	pb->bio = pb->orig_bio;
+	pb->orig_bio = NULL;
+}
+
+static void pretty_bitmap_unmark(struct pretty_bio *pb);
+
+static void pretty_bio_complete(struct pretty_bio *pb)
+{
+	bool queue_ref = pb->queue_ref;
+	struct bio *my_bio;
+
+	if (READ_ONCE(pretty_dev.sb_pending) && pretty_sb_wait(pb))
+		return;															// restarted by pretty_sb_update()
+
+	pretty_unalign_bio(pb);
+	my_bio = pb->bio;
+
+	if (pb->locked)
+		pretty_range_unlock(pb);
+	pretty_bitmap_unmark(pb);
+
+	free_crc_pages(pb, pb->crc_pages);
+	free_crc_pages(pb, pb->crc_pages_secondary);
+	pretty_free_blocks(pb);
+
+	if (pb->rq)
+		pretty_rq_put(pb->rq, pb->err == 1 ? BLK_STS_IOERR : BLK_STS_OK);
+	else if (pb->err == 1)
+		bio_io_error(my_bio);
+	else
+		bio_endio(my_bio);
+
+	bio_put(&pb->ctx_bio);
+	if (queue_ref)
+		percpu_ref_put(&pretty_dev.gd->queue->q_usage_counter);
+}
+
+/* Whole CRC sectors whose blocks hold zeroes on every leg, set by discard
+ * and write zeroes for the CRC sectors they cover and cleared by any write
+ * to them. Only a hint for reads to skip their I/O, see pretty_read_start():
+ * the legs and the CRC area hold the zeroes themselves, so it is not kept
+ * across loads. The range lock keeps the bits of the CRC sectors of a bio
+ * stable until it completes.
+ */
+static void pretty_zeroed_update(unsigned long long start, unsigned long long end, bool zeroed)
+{
+	unsigned long first, last;
+
+	if (zeroed) {
+		first = div_u64(start + DATA_SECTORS_PER_CRC_SECTOR - 1, DATA_SECTORS_PER_CRC_SECTOR);
+		last = div_u64(end, DATA_SECTORS_PER_CRC_SECTOR);
+	} else {
+		first = div_u64(start, DATA_SECTORS_PER_CRC_SECTOR);
+		last = div_u64(end - 1, DATA_SECTORS_PER_CRC_SECTOR) + 1;
+		if (find_next_bit(pretty_dev.zeroed, last, first) >= last)
+			return;
+	}
+	if (first >= last)
+		return;
+
+	spin_lock(&pretty_dev.zeroed_lock);
+	if (zeroed)
+		bitmap_set(pretty_dev.zeroed, first, last - first);
+	else
+		bitmap_clear(pretty_dev.zeroed, first, last - first);
+	spin_unlock(&pretty_dev.zeroed_lock);
+}
+
+/* every CRC sector of the bio holds zeroes */
+static bool pretty_zeroed(struct pretty_bio *pb)
+{
+	unsigned long first = pb->first_crc - pretty_dev.data_sectors, last = pb->last_crc - pretty_dev.data_sectors + 1;
+
+	return find_next_zero_bit(pretty_dev.zeroed, last, first) >= last;
+}
+
+/* every writable leg can zero blocks with write zeroes */
+static bool pretty_legs_zero(unsigned long legs)
+{
+	int leg;
+
+	for_each_set_bit(leg, &legs, pretty_dev.nr_legs)
+		if (!bdev_write_zeroes_sectors(pretty_dev.legs[leg]))
+			return false;
+
+	return true;
+}
+
+/* every CRC sector of the range is rewritten entirely by the whole blocks first..end - 1 */
+static bool crc_range_covered(struct pretty_bio *pb, unsigned long long first, unsigned long long end)
+{
+	unsigned long long first_sector, last_sector, first_offset, last_offset;
+
+	locate_crc_on_disks(first, &first_sector, &first_offset);
+	locate_crc_on_disks(end - 1, &last_sector, &last_offset);
+
+	return first_sector == pb->first_crc && first_offset == 0 &&
+	       last_sector == pb->last_crc && last_offset + pretty_dev.csum_size == KERNEL_SECTOR_SIZE;
+}
+
+/* the CRC range of the bio, reserved already, comes from the cache or the
+ * first active leg, unless the bio rewrites all of it
+ */
+static void pretty_load_crc_range(struct pretty_bio *pb, bool covered)
+{
+	if (!pb->crc_pages)
+		return;
+
+	if (covered || crc_cache_load(pb, pb->crc_pages))
+		return;
+
+	pretty_read_crc_range(pb, pretty_first_leg());
+}
+
+static void pretty_write_crc_done(struct pretty_bio *pb)
+{
+	if (pb->io_status)
+		pb->err = 1;
+
+	pretty_bio_complete(pb);
+}
+
+/* store the patched CRC range in the cache or write it to every leg */
+static void pretty_write_crc(struct pretty_bio *pb)
+{
+	unsigned long legs = pretty_writable_legs();
+	int leg;
+
+	if (crc_cache_store(pb, pb->crc_pages, true)) {
+		/* FUA covers the CRCs as well, the write-back takes its pages from
+		 * the same reserve as the CRC range so it is given back first
+		 */
+		if (pb->bio->bi_opf & REQ_FUA) {
+			free_crc_pages(pb, pb->crc_pages);
+			pb->crc_pages = NULL;
+			crc_cache_sync(pb, pretty_write_crc_done);
+		} else {
+			pretty_write_crc_done(pb);
+		}
+		return;
+	}
+
+	/* one write of the patched CRC range per leg */
+	pb->next = pretty_write_crc_done;
+	for_each_set_bit(leg, &legs, pretty_dev.nr_legs)
+		modify_crc_range_on_disk(pb, pretty_leg_disk(leg), pb->crc_pages);
+	pretty_io_put(pb);
+}
+
+static void compute_and_modify_crc_on_disks(struct pretty_bio *pb)
+{
+	if (!pb->crc_pages) {
+		/* nothing to checksum (empty flush) */
+		pretty_write_crc_done(pb);
+		return;
+	}
+
+	if (pretty_crc_range_retry(pb))
+		return;
+
+	/* the CRCs of the blocks around the bio are unknown, the range is not written */
+	if (pb->crc_status) {
+		pb->err = 1;
+		pretty_bio_complete(pb);
+		return;
+	}
+
+	if (pb->crc_from_disk)
+		crc_cache_merge(pb, pb->crc_pages);
+
+	/* CRCs of every block of the bio in one pass, then patched in the CRC pages */
+	compute_crc_bio(pb->bio, pb->checksums, pb->gather);
+	set_crcs_in_range(pb, pb->crc_pages, pb->bio->bi_iter.bi_sector, pb->checksums, pb->nr_blocks);
+
+	pretty_write_crc(pb);
+}
+
+static void pretty_write_data(struct pretty_bio *pb)
+{
+	unsigned long legs;
+	int leg;
+
+	if (!pretty_reserve(pb, 1, bio_sectors(pb->bio) >> pretty_dev.csum_shift, pretty_write_data))
+		return;
+
+	if (pretty_dev.csum_size)
+		pretty_zeroed_update(pb->bio->bi_iter.bi_sector, bio_end_sector(pb->bio), false);
+
+	legs = pretty_writable_legs();
+
+	/* clone the bio once per leg and send the clones together,
+	 * the CRC update starts when all of them completed
+	 */
+	pb->next = compute_and_modify_crc_on_disks;
+	for_each_set_bit(leg, &legs, pretty_dev.nr_legs)
+		retransmit_bio_data_on_disk(pb, pretty_leg_disk(leg), pb->bio);
+
+	/* CRC sectors shared with data outside the bio must be read first */
+	pretty_load_crc_range(pb, crc_range_covered(pb, pb->bio->bi_iter.bi_sector, bio_end_sector(pb->bio)));
+
+	pretty_io_put(pb);
+}
+
+/* the whole blocks of a discard or a write zeroes, zeroes on the legs by
+ * now, get the checksum of zeroes
+ */
+static void pretty_zero_crc(struct pretty_bio *pb)
+{
+	unsigned long long first = round_up(pb->bio->bi_iter.bi_sector, CSUM_BLOCK_SECTORS);
+	unsigned long long end = round_down(bio_end_sector(pb->bio), CSUM_BLOCK_SECTORS);
+	unsigned int k;
+
+	if (pb->crc_pages && pretty_crc_range_retry(pb))
+		return;
+
+	/* the legs keep their old CRCs on errors, an unread CRC range is not written */
+	if (!pb->crc_pages || pb->io_status || pb->crc_status) {
+		if (pb->crc_status)
+			pb->err = 1;
+		pretty_write_crc_done(pb);
+		return;
+	}
+
+	if (pb->crc_from_disk)
+		crc_cache_merge(pb, pb->crc_pages);
+
+	for (k = 0; k < pb->nr_blocks; k++)
+		pb->checksums[k] = pretty_dev.zero_csum;
+	set_crcs_in_range(pb, pb->crc_pages, first, pb->checksums, pb->nr_blocks);
+	pretty_zeroed_update(first, end, true);
+
+	pretty_write_crc(pb);
+}
+
+/* Discards reach the legs as write zeroes, which lets them unmap the space,
+ * for the whole checksum blocks they cover; partial blocks at the edges are
+ * left alone. The legs then really hold zeroes and the blocks get the
+ * checksum of zeroes, they are verified and repaired like any other. Unless
+ * every writable leg can zero, the discard, only a hint, is dropped. Without
+ * checksums it goes as is to the legs that support it.
+ */
+static void pretty_discard_start(struct pretty_bio *pb)
+{
+	unsigned long long start = pb->bio->bi_iter.bi_sector;
+	unsigned long long first = round_up(start, CSUM_BLOCK_SECTORS);
+	unsigned long long end = round_down(bio_end_sector(pb->bio), CSUM_BLOCK_SECTORS);
+	unsigned long legs = pretty_writable_legs();
+	struct bio *clone;
+	int leg;
+
+	if (first >= end || (pretty_dev.csum_size && !pretty_legs_zero(legs))) {
+		pretty_bio_complete(pb);
+		return;
+	}
+
+	if (!pretty_reserve(pb, 1, (end - first) >> pretty_dev.csum_shift, pretty_discard_start))
+		return;
+
+	pb->next = pretty_zero_crc;
+	for_each_set_bit(leg, &legs, pretty_dev.nr_legs) {
+		if (!pretty_dev.csum_size && !blk_queue_discard(bdev_get_queue(pretty_dev.legs[leg])))
+			continue;
+
+		clone = bio_clone_fast(pb->bio, GFP_NOIO, &pretty_dev.io_bio_set);
+		clone->bi_disk = pretty_leg_disk(leg);
+		if (pretty_dev.csum_size)
+			clone->bi_opf = REQ_OP_WRITE_ZEROES | (clone->bi_opf & ~REQ_OP_MASK);
+		bio_trim(clone, first - start, end - first);
+		pretty_io_submit(pb, clone);
+	}
+
+	/* the slots of partial blocks at the edges are kept, they must be read first */
+	pretty_load_crc_range(pb, crc_range_covered(pb, first, end));
+
+	pretty_io_put(pb);
+}
+
+/* How much of the other legs a successful read of the primary one verifies:
+ * "always"  - every block is also read from the other legs and compared (default)
+ * "primary" - only the CRC of the primary is checked, the others are read on errors
+ * "sampled" - verify_sample_percent of the bios are cross-verified
+ * Whatever is skipped here is left to the scrubber.
+ */
+enum {
+	VERIFY_ALWAYS,
+	VERIFY_PRIMARY,
+	VERIFY_SAMPLED,
+};
+
+static const char * const verify_policy_names[] = {
+	[VERIFY_ALWAYS] = "always",
+	[VERIFY_PRIMARY] = "primary",
+	[VERIFY_SAMPLED] = "sampled",
+};
+
+static int verify_policy = VERIFY_ALWAYS;
+static unsigned int verify_sample_percent = 10;
+
+static int verify_policy_set(const char *val, const struct kernel_param *kp)
+{
+	int policy = sysfs_match_string(verify_policy_names, val);
+
+	if (policy < 0)
+		return policy;
+
+	WRITE_ONCE(verify_policy, policy);
+
+	return 0;
+}
+
+static int verify_policy_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%s\n", verify_policy_names[READ_ONCE(verify_policy)]);
+}
+
+static const struct kernel_param_ops verify_policy_ops = {
+	.set = verify_policy_set,
+	.get = verify_policy_get,
+};
+
+module_param_cb(verify_policy, &verify_policy_ops, &verify_policy, 0644);
+MODULE_PARM_DESC(verify_policy, "Cross-verification of reads with the other legs: always, primary or sampled (default always)");
+module_param(verify_sample_percent, uint, 0644);
+MODULE_PARM_DESC(verify_sample_percent, "Percentage of reads cross-verified by the sampled policy (default 10)");
+
+static bool pretty_read_cross_verify(struct pretty_bio *pb)
+{
+	/* the scrubber and the resync check every leg whatever the policy */
+	if (pb->scrub || pb->resync)
+		return true;
+
+	switch (READ_ONCE(verify_policy)) {
+	case VERIFY_PRIMARY:
+		return false;
+	case VERIFY_SAMPLED:
+		return prandom_u32_max(100) < READ_ONCE(verify_sample_percent);
+	default:
+		return true;
+	}
+}
+
+/* Which leg a read goes to first, the other ones are only read to verify or
+ * recover blocks:
+ * "first"         - always the first leg
+ * "round-robin"   - each leg in turn
+ * "least-pending" - the leg with the fewest I/Os in flight (default)
+ * "nearest"       - on rotational legs the one whose last I/O ended closest
+ *                   to the bio, least-pending otherwise
+ */
+enum {
+	READ_BALANCE_FIRST,
+	READ_BALANCE_ROUND_ROBIN,
+	READ_BALANCE_LEAST_PENDING,
+	READ_BALANCE_NEAREST,
+};
+
+static const char * const read_balance_names[] = {
+	[READ_BALANCE_FIRST] = "first",
+	[READ_BALANCE_ROUND_ROBIN] = "round-robin",
+	[READ_BALANCE_LEAST_PENDING] = "least-pending",
+	[READ_BALANCE_NEAREST] = "nearest",
+};
+
+static int read_balance = READ_BALANCE_LEAST_PENDING;
+
+static int read_balance_set(const char *val, const struct kernel_param *kp)
+{
+	int policy = sysfs_match_string(read_balance_names, val);
+
+	if (policy < 0)
+		return policy;
+
+	WRITE_ONCE(read_balance, policy);
+
+	return 0;
+}
+
+static int read_balance_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%s\n", read_balance_names[READ_ONCE(read_balance)]);
+}
+
+static const struct kernel_param_ops read_balance_ops = {
+	.set = read_balance_set,
+	.get = read_balance_get,
+};
+
+module_param_cb(read_balance, &read_balance_ops, &read_balance, 0644);
+MODULE_PARM_DESC(read_balance, "Leg read first: first, round-robin, least-pending or nearest (default least-pending)");
+
+static unsigned long long pretty_head_distance(int leg, unsigned long long sector)
+{
+	unsigned long long head = READ_ONCE(pretty_dev.head[leg]);
+
+	return head > sector ? head - sector : sector - head;
+}
+
+static bool pretty_legs_rotational(void)
+{
+	unsigned long active = READ_ONCE(pretty_dev.active);
+	int leg;
+
+	for_each_set_bit(leg, &active, pretty_dev.nr_legs)
+		if (blk_queue_nonrot(bdev_get_queue(pretty_dev.legs[leg])))
+			return false;
+
+	return true;
+}
+
+static int pretty_read_choose_leg(struct pretty_bio *pb)
+{
+	unsigned long long sector = pb->bio->bi_iter.bi_sector;
+	unsigned long active = READ_ONCE(pretty_dev.active);
+	int leg, best = __ffs(active);
+
+	switch (READ_ONCE(read_balance)) {
+	case READ_BALANCE_FIRST:
+		return best;
+	case READ_BALANCE_ROUND_ROBIN:
+		leg = (unsigned int)atomic_inc_return(&pretty_dev.read_turn) % pretty_dev.nr_legs;
+		return active & BIT(leg) ? leg : best;
+	case READ_BALANCE_NEAREST:
+		if (pretty_legs_rotational()) {
+			for_each_set_bit(leg, &active, pretty_dev.nr_legs)
+				if (pretty_head_distance(leg, sector) < pretty_head_distance(best, sector))
+					best = leg;
+			return best;
+		}
+		fallthrough;
+	default:
+		for_each_set_bit(leg, &active, pretty_dev.nr_legs)
+			if (atomic_read(&pretty_dev.inflight[leg]) < atomic_read(&pretty_dev.inflight[best]))
+				best = leg;
+		return best;
+	}
+}
+
+/* the other legs are checked in order after the primary one */
+static void pretty_read_set_legs(struct pretty_bio *pb, int leg)
+{
+	pb->primary = leg;
+	pb->secondary = leg;
+}
+
+/* Scrubber: a kernel thread reads the whole logical disk in large chunks
+ * through the normal read path with cross-verification forced on, so every
+ * block is checked on every leg and repaired from the good copy. It only
+ * runs after /dev/ssr was idle for scrub_idle_ms and is throttled to scrub_kbps.
+ */
+enum {
+	SCRUB_STOPPED,
+	SCRUB_RUNNING,
+	SCRUB_PAUSED,
+};
+
+static const char * const scrub_state_names[] = {
+	[SCRUB_STOPPED] = "stopped",
+	[SCRUB_RUNNING] = "running",
+	[SCRUB_PAUSED] = "paused",
+};
+
+/* commands accepted by the scrub parameter, indexed by the state they lead to */
+static const char * const scrub_command_names[] = {
+	[SCRUB_STOPPED] = "stop",
+	[SCRUB_RUNNING] = "start",
+	[SCRUB_PAUSED] = "pause",
+};
+
+#define SCRUB_CHUNK_PAGES		BIO_MAX_PAGES
+#define SCRUB_CHUNK_SECTORS		(SCRUB_CHUNK_PAGES * (PAGE_SIZE / KERNEL_SECTOR_SIZE))
+
+static unsigned int scrub_kbps = 8192;
+static unsigned int scrub_idle_ms = 200;
+
+static struct pretty_scrub {
+	struct task_struct *task;
+	wait_queue_head_t wait;
+	struct page *pages[SCRUB_CHUNK_PAGES];
+	int state;
+	bool restart;											// start the next chunk from sector 0
+
+	atomic_long_t position, sectors, repaired, errors, passes;
+} scrub;
+
+static void pretty_scrub_account(struct pretty_bio *pb)
+{
+	unsigned long repaired = 0, lost = 0;
+	unsigned int k;
+
+	for (k = 0; k < pb->nr_blocks; k++) {
+		if (pb->sector_state[k] & SECTOR_BAD)
+			lost += CSUM_BLOCK_SECTORS;
+		else if (pb->block_repair[k])
+			repaired += CSUM_BLOCK_SECTORS;
+	}
+
+	/* the repair writes themselves failed */
+	if (pb->io_status) {
+		lost += repaired;
+		repaired = 0;
+	}
+
+	atomic_long_add(bio_sectors(pb->bio), &scrub.sectors);
+	atomic_long_add(repaired, &scrub.repaired);
+	atomic_long_add(lost, &scrub.errors);
+}
+
+/* bounce slot of block k of the bio, the slots of all the blocks are taken
+ * together the first time one is needed
+ */
+static struct page *bounce_page(struct pretty_bio *pb, unsigned int k, unsigned int *offset)
+{
+	unsigned int index = k / (PAGE_SIZE / CSUM_BLOCK_SIZE);
+
+	*offset = (k % (PAGE_SIZE / CSUM_BLOCK_SIZE)) * CSUM_BLOCK_SIZE;
+
+	return pb->bounce_pages[index];
+}
+
+/* one bio per run of adjacent blocks with one of the mask bits in state[], backed by the bounce slots */
+static void submit_bounce_runs(struct pretty_bio *pb, struct gendisk *gd, int dir, const u8 *state, u8 mask)
+{
+	unsigned long long first_sector = pb->bio->bi_iter.bi_sector;
+	unsigned int k, offset, block_size = CSUM_BLOCK_SIZE;
+	struct bio *bio = NULL;
+	struct page *page;
+
+	for (k = 0; k < pb->nr_blocks; k++) {
+		if (!(state[k] & mask))
+			continue;
+
+		page = bounce_page(pb, k, &offset);
+
+		if (bio && (bio_end_sector(bio) != first_sector + (k << pretty_dev.csum_shift) ||
+			    bio_add_page(bio, page, block_size, offset) != block_size)) {
+			pretty_io_submit(pb, bio);
+			bio = NULL;
+		}
+
+		if (!bio) {
+			bio = bio_alloc_bioset(GFP_NOIO, BIO_MAX_PAGES, &pretty_dev.io_bio_set);
+			bio->bi_disk = gd;										// set gendisk
+			bio->bi_opf = dir;										// set operation type
+			bio->bi_iter.bi_sector = first_sector + (k << pretty_dev.csum_shift);	// set sector
+			bio_add_page(bio, page, block_size, offset);
+		}
+	}
+
+	if (bio)
+		pretty_io_submit(pb, bio);
+}
+
+/* copy block k between the pages of the bio and its bounce slot */
+static void copy_block(struct pretty_bio *pb, unsigned int k, struct page *page, unsigned int offset, bool to_bio)
+{
+	copy_bio_data(pb->bio, k * CSUM_BLOCK_SIZE, (char *)page_address(page) + offset, CSUM_BLOCK_SIZE, to_bio);
+}
+
+static void pretty_resync_write(struct pretty_bio *pb, unsigned long legs);
+
+static void pretty_read_done(struct pretty_bio *pb)
+{
+	unsigned long rebuilding = READ_ONCE(pretty_dev.rebuilding);
+
+	/* keep the cache in sync with the repaired CRC ranges */
+	if (pb->repair_mask)
+		crc_cache_store(pb, pb->crc_pages, false);
+
+	if (pb->scrub)
+		pretty_scrub_account(pb);
+
+	/* a resync chunk repaired on the active legs still goes to the legs being rebuilt */
+	if (pb->resync && !pb->err && rebuilding) {
+		pretty_resync_write(pb, rebuilding);
+		return;
+	}
+
+	pretty_bio_complete(pb);
+}
+
+static void pretty_read_repair(struct pretty_bio *pb)
+{
+	unsigned int k, offset;
+	struct page *page;
+	int leg;
+
+	/* the bio holds the good copy of every block to repair, the CRC range
+	 * of the primary leg holds the good CRCs
+	 */
+	for (k = 0; k < pb->nr_blocks; k++) {
+		if (!pb->block_repair[k])
+			continue;
+
+		if (pb->sector_state[k] & SECTOR_BAD) {
+			/* INCORRECT DATA ON ALL LEGS */
+			pb->err = 1;
+			pb->block_repair[k] = 0;
+			continue;
+		}
+
+		page = bounce_page(pb, k, &offset);
+		copy_block(pb, k, page, offset, false);
+		pb->repair_mask |= pb->block_repair[k];
+	}
+
+	pb->next = pretty_read_done;
+	for (leg = 0; leg < pretty_dev.nr_legs; leg++) {
+		if (!(pb->repair_mask & BIT(leg)))
+			continue;
+
+		submit_bounce_runs(pb, pretty_leg_disk(leg), REQ_OP_WRITE, pb->block_repair, BIT(leg));
+		modify_crc_range_on_disk(pb, pretty_leg_disk(leg), pb->crc_pages);
+	}
+
+	pretty_io_put(pb);
+}
+
+static void pretty_read_check_leg(struct pretty_bio *pb);
+
+/* read the blocks still bad or to compare from the next leg, in leg order
+ * after the primary, and repair once every leg was checked
+ */
+static void pretty_read_next_leg(struct pretty_bio *pb)
+{
+	bool bad = false, read = false;
+	unsigned int k;
+
+	pb->secondary = pretty_next_leg(pb->secondary, pb->primary);
+	if (pb->secondary < 0) {
+		pb->secondary = pb->primary;
+		pretty_read_repair(pb);
+		return;
+	}
+
+	for (k = 0; k < pb->nr_blocks; k++) {
+		if (!(pb->sector_state[k] & (SECTOR_BAD | SECTOR_CHECK)))
+			continue;
+
+		pb->sector_state[k] |= SECTOR_READ;
+		bad |= pb->sector_state[k] & SECTOR_BAD;
+		read = true;
+	}
+
+	if (!read) {
+		pretty_read_repair(pb);
+		return;
+	}
+
+	/* the leg is read into bounce slots, only the blocks that need it */
+	pb->next = pretty_read_check_leg;
+	submit_bounce_runs(pb, pretty_leg_disk(pb->secondary), REQ_OP_READ, pb->sector_state, SECTOR_READ);
+
+	if (bad)
+		read_crc_range_from_disk(pb, pretty_leg_disk(pb->secondary), pb->crc_pages_secondary);
+
+	pretty_io_put(pb);
+}
+
+static void pretty_read_check_leg(struct pretty_bio *pb)
+{
+	unsigned long long data_sector;
+	unsigned int k, offset;
+	u64 checksum_secondary;
+	struct page *page;
+	bool secondary_failed;
+
+	secondary_failed = pb->io_status != BLK_STS_OK;
+	pb->io_status = BLK_STS_OK;
+
+	for (k = 0; k < pb->nr_blocks; k++) {
+		if (!(pb->sector_state[k] & SECTOR_READ))
+			continue;
+		pb->sector_state[k] &= ~SECTOR_READ;
+
+		data_sector = pb->bio->bi_iter.bi_sector + (k << pretty_dev.csum_shift);
+		page = bounce_page(pb, k, &offset);
+		checksum_secondary = compute_crc(page, offset);
+
+		if (pb->sector_state[k] & SECTOR_BAD) {
+			if (secondary_failed || get_crc_from_range(pb, pb->crc_pages_secondary, data_sector) != checksum_secondary) {
+				/* INCORRECT DATA ON THIS LEG TOO => try the next one */
+				pb->block_repair[k] |= BIT(pb->secondary);
+				continue;
+			}
+
+			/* FIRST LEG WITH A VALID CRC WINS => copy data in the bio and recover the legs before it */
+			copy_block(pb, k, page, offset, true);
+			set_crc_in_range(pb, pb->crc_pages, data_sector, checksum_secondary);
+			pb->sector_state[k] &= ~SECTOR_BAD;
+		} else if (secondary_failed || checksum_secondary != pb->checksums[k]) {
+			/* INCORRECT DATA ON THIS LEG => copy from PRIMARY */
+			pb->block_repair[k] |= BIT(pb->secondary);
+		}
+	}
+
+	pretty_read_next_leg(pb);
+}
+
+static void pretty_read_verify(struct pretty_bio *pb)
+{
+	bool primary_failed, check_legs = false;
+	bool cross_verify = pretty_read_cross_verify(pb);
+	unsigned long long first_sector = pb->bio->bi_iter.bi_sector;
+	unsigned int k;
+	u64 checksum;
+
+	if (pretty_crc_range_retry(pb))
+		return;
+
+	/* nothing to check the data against, nothing is repaired or cached */
+	if (pb->crc_status) {
+		pb->err = 1;
+		pretty_read_done(pb);
+		return;
+	}
+
+	primary_failed = pb->io_status != BLK_STS_OK;
+	pb->io_status = BLK_STS_OK;
+
+	if (pb->crc_from_disk)
+		crc_cache_merge(pb, pb->crc_pages);
+
+	/* the data of the primary is already in the pages of the bio, check it in place */
+	compute_crc_bio(pb->bio, pb->checksums, pb->gather);
+
+	for (k = 0; k < pb->nr_blocks; k++) {
+		checksum = get_crc_from_range(pb, pb->crc_pages, first_sector + (k << pretty_dev.csum_shift));
+
+		if (primary_failed || checksum != pb->checksums[k]) {
+			/* DATA IS INCORRECT ON PRIMARY */
+			pb->sector_state[k] = SECTOR_BAD;
+			pb->block_repair[k] = BIT(pb->primary);
+			check_legs = true;
+		} else if (cross_verify) {
+			/* VERIFY DATA IS CORRECT ON THE OTHER LEGS as well, if not => recover from PRIMARY */
+			pb->sector_state[k] = SECTOR_CHECK;
+			check_legs = true;
+		}
+	}
+
+	if (!check_legs) {
+		pretty_read_done(pb);
+		return;
+	}
+
+	/* the other legs are read into bounce slots, taken the first time */
+	if (!pretty_get_bounce_pages(pb, pretty_read_next_leg))
+		return;
+
+	pretty_read_next_leg(pb);
+}
+
+/* Large reads are split in chunks of read_split_kb read from the legs in
+ * turn at the same time. Every chunk runs the whole read path on its
+ * own: it is read into the pages of the original bio, verified and repaired,
+ * the original bio completes with the last chunk. The range lock is held by
+ * the original bio, chunks end on a multiple of the split size so that no two
+ * of them share a CRC sector.
+ */
+static unsigned int read_split_kb = 128;
+
+module_param(read_split_kb, uint, 0644);
+MODULE_PARM_DESC(read_split_kb, "Reads larger than this are split across the legs, 0 disables it (default 128)");
+
+/* the bio of a child is freed with its pretty_bio by pretty_bio_complete() */
+static void pretty_split_endio(struct bio *bio)
+{
+	struct pretty_bio *pb = bio->bi_private;
+
+	if (bio->bi_status)
+		pb->err = 1;
+
+	pretty_io_put(pb);
+}
+
+/* A sub-bio that runs the whole I/O path on its own: a chunk of a split
+ * read, a write zeroes rewritten as a write or an edge block of a write.
+ * Its pretty_bio is the front_pad of the bio itself, which comes from
+ * split_bio_set or edge_bio_set, never from the bio_set of its parent.
+ */
+static struct pretty_bio *pretty_bio_child(struct bio *bio, struct pretty_bio *parent)
+{
+	struct pretty_bio *child = pretty_bio_init(bio);
+
+	child->bio = bio;
+	bio->bi_private = parent;
+	bio->bi_end_io = pretty_split_endio;
+
+	return child;
+}
+
+static void pretty_read_start(struct pretty_bio *pb);
+
+static bool pretty_read_split(struct pretty_bio *pb)
+{
+	unsigned long long sector = pb->bio->bi_iter.bi_sector, end = bio_end_sector(pb->bio), chunk_end;
+	unsigned int split = READ_ONCE(read_split_kb) * 2;
+	struct pretty_bio *chunk;
+	u32 rem;
+	int leg;
+
+	if (!split)
+		return false;
+	if (pretty_dev.csum_size)
+		split = roundup(split, DATA_SECTORS_PER_CRC_SECTOR);
+
+	div_u64_rem(sector, split, &rem);
+	if (sector + split - rem >= end)
+		return false;
+
+	leg = pretty_read_choose_leg(pb);
+	pb->next = pretty_bio_complete;
+
+	for (; sector < end; sector = chunk_end, leg = pretty_next_leg(leg, -1)) {
+		div_u64_rem(sector, split, &rem);
+		chunk_end = min(sector + split - rem, end);
+
+		chunk = pretty_bio_child(bio_clone_fast(pb->bio, GFP_NOIO, &pretty_dev.split_bio_set), pb);
+		bio_trim(chunk->bio, sector - pb->bio->bi_iter.bi_sector, chunk_end - sector);
+
+		chunk->scrub = pb->scrub;
+		chunk->next = pretty_read_start;
+		pretty_read_set_legs(chunk, leg);
+		locate_crc_range(chunk);
+
+		atomic_inc(&pb->pending);
+		queue_work(pretty_dev.queue, &chunk->work);
+	}
+
+	pretty_io_put(pb);
+
+	return true;
+}
+
+/* without checksums only an I/O error tells a bad copy, the other legs are
+ * read in order until one succeeds
+ */
+static void pretty_read_plain(struct pretty_bio *pb)
+{
+	if (!pb->io_status) {
+		pretty_read_done(pb);
+		return;
+	}
+
+	pb->secondary = pretty_next_leg(pb->secondary, pb->primary);
+	if (pb->secondary < 0) {
+		pb->secondary = pb->primary;
+		pb->err = 1;
+		pretty_read_done(pb);
+		return;
+	}
+
+	pb->io_status = BLK_STS_OK;
+	retransmit_bio_data_on_disk(pb, pretty_leg_disk(pb->secondary), pb->bio);
+	pretty_io_put(pb);
+}
+
+static void pretty_read_plain_start(struct pretty_bio *pb)
+{
+	if (pb->primary < 0)
+		pretty_read_set_legs(pb, pretty_read_choose_leg(pb));
+	pb->next = pretty_read_plain;
+	retransmit_bio_data_on_disk(pb, pretty_leg_disk(pb->primary), pb->bio);
+	pretty_io_put(pb);
+}
+
+static void pretty_read_start(struct pretty_bio *pb)
+{
+	bool cached;
+
+	if (!pb->bio->bi_iter.bi_size) {
+		pretty_bio_complete(pb);
+		return;
+	}
+
+	/* whole checksum blocks are read, the chunks of a split read are aligned already */
+	if (!pretty_align_bio(pb, pretty_read_start))
+		return;
+
+	/* the chunks of a split read have their legs set already */
+	if (pb->primary < 0 && pretty_read_split(pb))
+		return;
+
+	if (!pretty_dev.csum_size) {
+		pretty_read_plain_start(pb);
+		return;
+	}
+
+	/* nothing to read when the whole bio was discarded or zeroed */
+	if (!pb->scrub && !pb->resync && pretty_zeroed(pb)) {
+		zero_fill_bio(pb->bio);
+		pretty_read_done(pb);
+		return;
+	}
+
+	/* the CRCs of the whole bio come from the cache or from the primary with
+	 * one I/O, the range of the other legs is only read for bad blocks
+	 */
+	if (!pretty_reserve(pb, 2, bio_sectors(pb->bio) >> pretty_dev.csum_shift, pretty_read_start))
+		return;
+	cached = crc_cache_load(pb, pb->crc_pages);
+
+	/* read the primary leg straight into the pages of the bio */
+	if (pb->primary < 0)
+		pretty_read_set_legs(pb, pretty_read_choose_leg(pb));
+	pb->next = pretty_read_verify;
+	retransmit_bio_data_on_disk(pb, pretty_leg_disk(pb->primary), pb->bio);
+
+	if (!cached)
+		pretty_read_crc_range(pb, pb->primary);
+
+	pretty_io_put(pb);
+}
+
+/* read one edge block of a write through the read path, it is verified and
+ * repaired like any read and fails only when no leg has a good copy
+ */
+static void pretty_read_edge(struct pretty_bio *pb, struct page *page, unsigned long long sector)
+{
+	struct pretty_bio *edge = pretty_bio_child(bio_alloc_bioset(GFP_NOIO, 1, &pretty_dev.edge_bio_set), pb);
+
+	edge->bio->bi_disk = pretty_dev.gd;
+	edge->bio->bi_opf = REQ_OP_READ;
+	edge->bio->bi_iter.bi_sector = sector;
+	bio_add_page(edge->bio, page, CSUM_BLOCK_SIZE, 0);
+
+	/* the range lock is held by the write */
+	edge->next = pretty_read_start;
+	locate_crc_range(edge);
+
+	atomic_inc(&pb->pending);
+	queue_work(pretty_dev.queue, &edge->work);
+}
+
+static void pretty_write_merge(struct pretty_bio *pb)
+{
+	/* an edge block is lost on every leg, do not write a CRC over it */
+	if (pb->err) {
+		pretty_bio_complete(pb);
+		return;
+	}
+
+	copy_edges(pb, false);
+	pretty_write_data(pb);
+}
+
+static void pretty_write_start(struct pretty_bio *pb)
+{
+	if (!pretty_align_bio(pb, pretty_write_start))
+		return;
+	if (!pb->orig_bio) {
+		pretty_write_data(pb);
+		return;
+	}
+
+	/* read-modify-write of the partial blocks at the edges */
+	pb->next = pretty_write_merge;
+	if (pb->edge_pages[0])
+		pretty_read_edge(pb, pb->edge_pages[0], pb->bio->bi_iter.bi_sector);
+	if (pb->edge_pages[1])
+		pretty_read_edge(pb, pb->edge_pages[1], bio_end_sector(pb->bio) - CSUM_BLOCK_SECTORS);
+	pretty_io_put(pb);
+}
+
+/* write zeroes of a range that starts or ends inside a checksum block:
+ * plain writes of zero pages through the write path, which merges the edges.
+ * The aligned copy of a write takes two more segments, so they are cut
+ * short of BIO_MAX_PAGES, on a CRC sector so that no two of them share one.
+ */
+static void pretty_write_zeroes_slow(struct pretty_bio *pb)
+{
+	unsigned long long sector = pb->bio->bi_iter.bi_sector, end = bio_end_sector(pb->bio), chunk_end;
+	unsigned int split = rounddown((BIO_MAX_PAGES - 2) * (PAGE_SIZE / KERNEL_SECTOR_SIZE), DATA_SECTORS_PER_CRC_SECTOR);
+	struct pretty_bio *zero;
+	unsigned int len;
+	u32 rem;
+
+	pb->next = pretty_bio_complete;
+
+	for (; sector < end; sector = chunk_end) {
+		div_u64_rem(sector, split, &rem);
+		chunk_end = min(sector + split - rem, end);
+		len = (chunk_end - sector) * KERNEL_SECTOR_SIZE;
+
+		zero = pretty_bio_child(bio_alloc_bioset(GFP_NOIO, DIV_ROUND_UP(len, PAGE_SIZE), &pretty_dev.split_bio_set), pb);
+		zero->bio->bi_disk = pretty_dev.gd;
+		zero->bio->bi_opf = REQ_OP_WRITE | (pb->bio->bi_opf & REQ_FUA);
+		zero->bio->bi_iter.bi_sector = sector;
+		for (; len; len -= min_t(unsigned int, len, PAGE_SIZE))
+			bio_add_page(zero->bio, ZERO_PAGE(0), min_t(unsigned int, len, PAGE_SIZE), 0);
+
+		/* the range lock is held by the write zeroes */
+		zero->next = pretty_write_start;
+		locate_crc_range(zero);
+
+		atomic_inc(&pb->pending);
+		queue_work(pretty_dev.queue, &zero->work);
+	}
+
+	pretty_io_put(pb);
+}
+
+/* Write zeroes is offloaded to every leg and the CRC slots of the range are
+ * set to the checksum of zeroes in one pass. When a writable leg has no
+ * offload, zero pages are written through the write path instead. Without
+ * checksums it is only advertised when every leg supports it.
+ */
+static void pretty_write_zeroes_start(struct pretty_bio *pb)
+{
+	unsigned long long start = pb->bio->bi_iter.bi_sector, end = bio_end_sector(pb->bio);
+	unsigned long legs = pretty_writable_legs();
+	int leg;
+
+	if (!IS_ALIGNED(start, CSUM_BLOCK_SECTORS) || !IS_ALIGNED(end, CSUM_BLOCK_SECTORS) || !pretty_legs_zero(legs)) {
+		pretty_write_zeroes_slow(pb);
+		return;
+	}
+
+	if (!pretty_reserve(pb, 1, (end - start) >> pretty_dev.csum_shift, pretty_write_zeroes_start))
+		return;
+
+	pb->next = pretty_zero_crc;
+	for_each_set_bit(leg, &legs, pretty_dev.nr_legs)
+		retransmit_bio_data_on_disk(pb, pretty_leg_disk(leg), pb->bio);
+
+	pretty_load_crc_range(pb, crc_range_covered(pb, start, end));
+
+	pretty_io_put(pb);
+}
+
+/* sectors of a write zeroes bio, 0 when it cannot be offloaded */
+static unsigned int pretty_write_zeroes_sectors(void)
+{
+	unsigned int sectors = PRETTY_MAX_SECTORS;
+	int leg;
+
+	if (pretty_dev.csum_size)
+		return sectors;
+
+	for (leg = 0; leg < pretty_dev.nr_legs; leg++)
+		if (pretty_dev.legs[leg])
+			sectors = min(sectors, bdev_write_zeroes_sectors(pretty_dev.legs[leg]));
+
+	return sectors;
+}
+
+/* Write-intent bitmap: one bit per region of 2^bitmap_shift sectors, on
+ * every leg right after the CRC area. A write waits until the bits of its
+ * regions are on every leg, so after a crash the legs and the CRCs can only
+ * differ in the regions with a bit set and only those are resynchronised.
+ * Bits are set in batches like the flushes, see pretty_flush_wait(), and
+ * cleared lazily by a pass every bitmap_clear_ms once a region saw no write
+ * for a whole period and its data and CRCs are durable on every leg.
+ */
+#define BITMAP_BITS_PER_PAGE	(PAGE_SIZE * 8)
+#define BITMAP_MAX_PAGES		BIO_MAX_PAGES
+
+static unsigned int bitmap_clear_ms = 5000;
+
+static struct pretty_bitmap {
+	spinlock_t lock;
+	unsigned long nr_regions;
+	unsigned int nr_pages;
+	unsigned long *wanted;										// bits the legs must have
+	unsigned long *ondisk;										// bits on every leg
+	unsigned long *writing;										// bits of the write in flight
+	unsigned long *seen;										// regions written since the last clear pass
+	unsigned long *resync;										// dirty at load time, kept until resynced
+	unsigned long *clearing;									// regions the clear pass is about to clear
+	unsigned int *writers;										// writes in flight per region
+	DECLARE_BITMAP(dirty_pages, BITMAP_MAX_PAGES);				// pages of wanted not written yet
+	DECLARE_BITMAP(written, BITMAP_MAX_PAGES);					// pages of the write in flight
+	struct page *snap[BITMAP_MAX_PAGES];						// on-disk image of the write in flight
+
+	/* bios waiting for their bits, those that came before the write in flight and after */
+	struct list_head waiters, running;
+	bool busy;
+	wait_queue_head_t idle;
+	struct work_struct work;
+	struct delayed_work clear;
+	atomic_t pending;
+
+	atomic_long_t writes;
+} bitmap;
+
+module_param(bitmap_clear_ms, uint, 0644);
+MODULE_PARM_DESC(bitmap_clear_ms, "Idle time after which a region is cleared in the write-intent bitmap (default 5000)");
+module_param_cb(bitmap_writes, &pretty_counter_ops, &bitmap.writes, 0444);
+
+static void pretty_bitmap_set(unsigned long region, bool dirty)
+{
+	if (test_bit(region, bitmap.wanted) == dirty)
+		return;
+
+	if (dirty)
+		set_bit(region, bitmap.wanted);
+	else
+		clear_bit(region, bitmap.wanted);
+	set_bit(region / BITMAP_BITS_PER_PAGE, bitmap.dirty_pages);
+}
+
+/* the on-disk bitmap is an array of little-endian 32 bit words */
+static void pretty_bitmap_to_page(unsigned int p)
+{
+	unsigned long first = (unsigned long)p * BITMAP_BITS_PER_PAGE;
+	unsigned int nbits = min_t(unsigned long, BITMAP_BITS_PER_PAGE, bitmap.nr_regions - first);
+	u32 *words = page_address(bitmap.snap[p]);
+	unsigned int i;
+
+	memset(words, 0, PAGE_SIZE);
+	bitmap_to_arr32(words, bitmap.wanted + first / BITS_PER_LONG, nbits);
+	for (i = 0; i < DIV_ROUND_UP(nbits, 32); i++)
+		cpu_to_le32s(&words[i]);
+
+	memcpy(bitmap.writing + first / BITS_PER_LONG, bitmap.wanted + first / BITS_PER_LONG,
+	       BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+static void pretty_bitmap_from_page(unsigned int p, unsigned long *bits)
+{
+	unsigned long first = (unsigned long)p * BITMAP_BITS_PER_PAGE;
+	unsigned int nbits = min_t(unsigned long, BITMAP_BITS_PER_PAGE, bitmap.nr_regions - first);
+	u32 *words = page_address(bitmap.snap[p]);
+	unsigned int i;
+
+	for (i = 0; i < DIV_ROUND_UP(nbits, 32); i++)
+		le32_to_cpus(&words[i]);
+	bitmap_from_arr32(bits + first / BITS_PER_LONG, words, nbits);
+}
+
+static struct bio *pretty_bitmap_bio(int leg, unsigned int p, int op)
+{
+	unsigned int sectors = min_t(unsigned long long, PAGE_SIZE / KERNEL_SECTOR_SIZE,
+				     BITMAP_SECTORS - p * (PAGE_SIZE / KERNEL_SECTOR_SIZE));
+	struct bio *bio = bio_alloc_bioset(GFP_NOIO, 1, &pretty_dev.io_bio_set);
+
+	bio->bi_disk = pretty_leg_disk(leg);
+	bio->bi_opf = op;
+	bio->bi_iter.bi_sector = CRC_AREA_END + p * (PAGE_SIZE / KERNEL_SECTOR_SIZE);
+	bio_add_page(bio, bitmap.snap[p], sectors * KERNEL_SECTOR_SIZE, 0);
+
+	return bio;
+}
+
+static void pretty_bitmap_endio(struct bio *bio)
+{
+	int leg = pretty_leg(bio->bi_disk);
+
+	if (bio->bi_status && (WARN_ON_ONCE(leg < 0) || !pretty_leg_fail(leg)))
+		pr_err_ratelimited("bitmap: write to leg %d failed\n", leg);
+
+	if (leg >= 0)
+		pretty_leg_dec(leg);
+	bio_put(bio);
+	if (atomic_dec_and_test(&bitmap.pending))
+		queue_work(pretty_dev.queue, &bitmap.work);
+}
+
+/* write the changed pages to every leg for the bios waiting so far */
+static void pretty_bitmap_issue(void)
+{
+	unsigned long legs = pretty_get_writable_legs();
+	unsigned int p;
+	struct bio *bio;
+	int leg;
+
+	spin_lock(&bitmap.lock);
+	list_splice_init(&bitmap.waiters, &bitmap.running);
+	bitmap_copy(bitmap.written, bitmap.dirty_pages, BITMAP_MAX_PAGES);
+	bitmap_zero(bitmap.dirty_pages, BITMAP_MAX_PAGES);
+	for_each_set_bit(p, bitmap.written, bitmap.nr_pages)
+		pretty_bitmap_to_page(p);
+	spin_unlock(&bitmap.lock);
+
+	atomic_set(&bitmap.pending, 1);
+	for_each_set_bit(p, bitmap.written, bitmap.nr_pages) {
+		for_each_set_bit(leg, &legs, pretty_dev.nr_legs) {
+			bio = pretty_bitmap_bio(leg, p, REQ_OP_WRITE | REQ_FUA);
+			bio->bi_end_io = pretty_bitmap_endio;
+			atomic_inc(&bitmap.pending);
+			atomic_inc(&pretty_dev.inflight[leg]);
+			submit_bio(bio);
+		}
+		atomic_long_inc(&bitmap.writes);
+	}
+	pretty_put_legs(legs);
+
+	if (atomic_dec_and_test(&bitmap.pending))
+		queue_work(pretty_dev.queue, &bitmap.work);
+}
+
+static void pretty_bitmap_done(struct work_struct *work)
+{
+	struct pretty_bio *pb, *tmp;
+	unsigned long first;
+	unsigned int p;
+	bool again;
+
+	spin_lock(&bitmap.lock);
+	for_each_set_bit(p, bitmap.written, bitmap.nr_pages) {
+		first = (unsigned long)p * BITMAP_BITS_PER_PAGE;
+		memcpy(bitmap.ondisk + first / BITS_PER_LONG, bitmap.writing + first / BITS_PER_LONG,
+		       BITS_TO_LONGS(min_t(unsigned long, BITMAP_BITS_PER_PAGE, bitmap.nr_regions - first)) *
+		       sizeof(unsigned long));
+	}
+
+	list_for_each_entry_safe(pb, tmp, &bitmap.running, wait_node) {
+		list_del(&pb->wait_node);
+		queue_work(pretty_dev.queue, &pb->work);
+	}
+
+	again = !list_empty(&bitmap.waiters) || !bitmap_empty(bitmap.dirty_pages, BITMAP_MAX_PAGES);
+	bitmap.busy = again;
+	spin_unlock(&bitmap.lock);
+
+	if (again)
+		pretty_bitmap_issue();
+	else
+		wake_up(&bitmap.idle);
+}
+
+/* run next once the regions of the bio are dirty on every leg */
+static void pretty_bitmap_mark(struct pretty_bio *pb, void (*next)(struct pretty_bio *pb))
+{
+	unsigned long region, first, last;
+	bool wait = false, start = false;
+
+	if (!pretty_dev.bitmap_shift || !pb->bio->bi_iter.bi_size) {
+		next(pb);
+		return;
+	}
+
+	first = pb->bio->bi_iter.bi_sector >> pretty_dev.bitmap_shift;
+	last = (bio_end_sector(pb->bio) - 1) >> pretty_dev.bitmap_shift;
+	pb->next = next;
+	pb->marked = true;
+
+	spin_lock(&bitmap.lock);
+	for (region = first; region <= last; region++) {
+		bitmap.writers[region]++;
+		set_bit(region, bitmap.seen);
+		if (!test_bit(region, bitmap.wanted) || !test_bit(region, bitmap.ondisk)) {
+			pretty_bitmap_set(region, true);
+			wait = true;
+		}
+	}
+
+	if (wait) {
+		list_add_tail(&pb->wait_node, &bitmap.waiters);
+		start = !bitmap.busy;
+		bitmap.busy = true;
+	}
+	spin_unlock(&bitmap.lock);
+
+	if (!wait)
+		next(pb);
+	else if (start)
+		pretty_bitmap_issue();
+}
+
+static void pretty_bitmap_unmark(struct pretty_bio *pb)
+{
+	unsigned long region;
+
+	if (!pb->marked)
+		return;
+
+	spin_lock(&bitmap.lock);
+	for (region = pb->bio->bi_iter.bi_sector >> pretty_dev.bitmap_shift;
+	     region <= (bio_end_sector(pb->bio) - 1) >> pretty_dev.bitmap_shift; region++)
+		bitmap.writers[region]--;
+	spin_unlock(&bitmap.lock);
+}
+
+/* the data of every write completed so far is durable on every leg */
+static bool pretty_bitmap_flush_legs(void)
+{
+	unsigned long legs = pretty_get_writable_legs();
+	struct bio *bio;
+	bool ok = true;
+	int leg;
+
+	for_each_set_bit(leg, &legs, pretty_dev.nr_legs) {
+		bio = bio_alloc_bioset(GFP_NOIO, 0, &pretty_dev.io_bio_set);
+		bio->bi_disk = pretty_leg_disk(leg);
+		bio->bi_opf = REQ_OP_WRITE | REQ_PREFLUSH;
+
+		if (submit_bio_wait(bio) && !pretty_leg_fail(leg))
+			ok = false;
+		bio_put(bio);
+	}
+	pretty_put_legs(legs);
+
+	return ok;
+}
+
+/* the CRCs of these sectors are not on the legs yet */
+static void pretty_bitmap_keep(unsigned long long sector, unsigned int nr_sectors)
+{
+	unsigned long region, last = (sector + nr_sectors - 1) >> pretty_dev.bitmap_shift;
+
+	for (region = sector >> pretty_dev.bitmap_shift; region <= last && region < bitmap.nr_regions; region++)
+		clear_bit(region, bitmap.clearing);
+}
+
+static bool pretty_bitmap_idle(unsigned long region)
+{
+	return !bitmap.writers[region] && !(bitmap.resync && test_bit(region, bitmap.resync));
+}
+
+static void pretty_bitmap_clear(struct work_struct *work)
+{
+	unsigned long region;
+	bool start;
+
+	/* a leg left out misses every write since, the bits tell a re-add what to copy */
+	if (pretty_degraded())
+		goto out;
+
+	spin_lock(&bitmap.lock);
+	bitmap_zero(bitmap.clearing, bitmap.nr_regions);
+	for_each_set_bit(region, bitmap.wanted, bitmap.nr_regions) {
+		if (!pretty_bitmap_idle(region))
+			continue;
+		if (test_and_clear_bit(region, bitmap.seen))
+			continue;
+		set_bit(region, bitmap.clearing);
+	}
+	spin_unlock(&bitmap.lock);
+
+	if (bitmap_empty(bitmap.clearing, bitmap.nr_regions))
+		goto out;
+
+	/* the writes the regions saw may still have their CRCs in the cache and
+	 * their data in the volatile cache of the legs: the CRCs are written back,
+	 * the legs flushed, then the regions with a CRC left in the cache or a
+	 * write since are kept
+	 */
+	crc_cache_flush();
+	if (!pretty_bitmap_flush_legs() || pretty_degraded())
+		goto out;
+	crc_cache_for_each_unwritten(pretty_bitmap_keep);
+
+	spin_lock(&bitmap.lock);
+	for_each_set_bit(region, bitmap.clearing, bitmap.nr_regions)
+		if (pretty_bitmap_idle(region) && !test_bit(region, bitmap.seen))
+			pretty_bitmap_set(region, false);
+
+	start = !bitmap.busy && !bitmap_empty(bitmap.dirty_pages, BITMAP_MAX_PAGES);
+	if (start)
+		bitmap.busy = true;
+	spin_unlock(&bitmap.lock);
+
+	if (start)
+		pretty_bitmap_issue();
+
+out:
+	queue_delayed_work(pretty_dev.queue, &bitmap.clear, msecs_to_jiffies(READ_ONCE(bitmap_clear_ms)));
+}
+
+/* a resync of the dirty regions only reads the chunks with one */
+static bool pretty_bitmap_resync_needed(unsigned long long sector, unsigned int nr_sectors)
+{
+	unsigned long first = sector >> pretty_dev.bitmap_shift;
+	unsigned long last = (sector + nr_sectors - 1) >> pretty_dev.bitmap_shift;
+	bool needed;
+
+	if (!pretty_dev.bitmap_shift)
+		return false;
+
+	spin_lock(&bitmap.lock);
+	needed = bitmap.resync && find_next_bit(bitmap.resync, last + 1, first) <= last;
+	spin_unlock(&bitmap.lock);
+
+	return needed;
+}
+
+/* after a complete resync pass the regions are left to the clear pass */
+static void pretty_bitmap_resynced(void)
+{
+	unsigned long *resync;
+
+	if (!pretty_dev.bitmap_shift)
+		return;
+
+	spin_lock(&bitmap.lock);
+	resync = bitmap.resync;
+	bitmap.resync = NULL;
+	spin_unlock(&bitmap.lock);
+
+	bitmap_free(resync);
+}
+
+/* a leg coming back only needs the regions written while it was out, returns
+ * false when the whole disk must be copied
+ */
+static bool pretty_bitmap_rebuild(void)
+{
+	unsigned long *resync;
+
+	if (!pretty_dev.bitmap_shift)
+		return false;
+
+	resync = bitmap_zalloc(bitmap.nr_regions, GFP_KERNEL);
+	if (!resync)
+		return false;
+
+	spin_lock(&bitmap.lock);
+	if (bitmap.resync)
+		bitmap_or(resync, resync, bitmap.resync, bitmap.nr_regions);
+	bitmap_or(resync, resync, bitmap.wanted, bitmap.nr_regions);
+	swap(resync, bitmap.resync);
+	spin_unlock(&bitmap.lock);
+
+	bitmap_free(resync);
+
+	return true;
+}
+
+static void pretty_bitmap_free(void)
+{
+	unsigned int p;
+
+	for (p = 0; p < bitmap.nr_pages; p++)
+		if (bitmap.snap[p])
+			__free_page(bitmap.snap[p]);
+	kvfree(bitmap.writers);
+	bitmap_free(bitmap.resync);
+	bitmap_free(bitmap.clearing);
+	bitmap_free(bitmap.seen);
+	bitmap_free(bitmap.writing);
+	bitmap_free(bitmap.ondisk);
+	bitmap_free(bitmap.wanted);
+}
+
+/* the bits set on any leg at load time are the regions to resynchronise */
+static int pretty_bitmap_init(void)
+{
+	unsigned long dirty;
+	unsigned int p;
+	struct bio *bio;
+	int leg;
+
+	if (!pretty_dev.bitmap_shift)
+		return 0;
+
+	spin_lock_init(&bitmap.lock);
+	INIT_LIST_HEAD(&bitmap.waiters);
+	INIT_LIST_HEAD(&bitmap.running);
+	init_waitqueue_head(&bitmap.idle);
+	INIT_WORK(&bitmap.work, pretty_bitmap_done);
+	INIT_DELAYED_WORK(&bitmap.clear, pretty_bitmap_clear);
+
+	bitmap.nr_regions = BITMAP_REGIONS;
+	bitmap.nr_pages = DIV_ROUND_UP(BITMAP_SECTORS * KERNEL_SECTOR_SIZE, PAGE_SIZE);
+	bitmap.wanted = bitmap_zalloc(bitmap.nr_regions, GFP_KERNEL);
+	bitmap.ondisk = bitmap_zalloc(bitmap.nr_regions, GFP_KERNEL);
+	bitmap.writing = bitmap_zalloc(bitmap.nr_regions, GFP_KERNEL);
+	bitmap.seen = bitmap_zalloc(bitmap.nr_regions, GFP_KERNEL);
+	bitmap.clearing = bitmap_zalloc(bitmap.nr_regions, GFP_KERNEL);
+	bitmap.writers = kvcalloc(bitmap.nr_regions, sizeof(*bitmap.writers), GFP_KERNEL);
+	if (!bitmap.wanted || !bitmap.ondisk || !bitmap.writing || !bitmap.seen || !bitmap.clearing || !bitmap.writers)
+		goto out_free;
+
+	for (p = 0; p < bitmap.nr_pages; p++) {
+		bitmap.snap[p] = alloc_page(GFP_KERNEL);
+		if (!bitmap.snap[p])
+			goto out_free;
+	}
+
+	for_each_set_bit(leg, &pretty_dev.active, pretty_dev.nr_legs) {
+		for (p = 0; p < bitmap.nr_pages; p++) {
+			bio = pretty_bitmap_bio(leg, p, REQ_OP_READ);
+			if (submit_bio_wait(bio)) {
+				pr_err("bitmap: unable to read it from leg %d\n", leg);
+				bio_put(bio);
+				continue;
+			}
+			bio_put(bio);
+
+			pretty_bitmap_from_page(p, bitmap.writing);
+		}
+		bitmap_or(bitmap.wanted, bitmap.wanted, bitmap.writing, bitmap.nr_regions);
+	}
+	bitmap_copy(bitmap.ondisk, bitmap.wanted, bitmap.nr_regions);
+
+	dirty = bitmap_weight(bitmap.wanted, bitmap.nr_regions);
+	if (dirty) {
+		bitmap.resync = bitmap_alloc(bitmap.nr_regions, GFP_KERNEL);
+		if (!bitmap.resync)
+			goto out_free;
+		bitmap_copy(bitmap.resync, bitmap.wanted, bitmap.nr_regions);
+		pr_warn("bitmap: %lu dirty regions of %llu KiB after an unclean shutdown\n", dirty,
+			(1ULL << pretty_dev.bitmap_shift) / 2);
+	}
+
+	queue_delayed_work(pretty_dev.queue, &bitmap.clear, msecs_to_jiffies(READ_ONCE(bitmap_clear_ms)));
+
+	return 0;
+
+out_free:
+	pretty_bitmap_free();
+	return -ENOMEM;
+}
+
+/* every write completed, only the regions still to resync stay dirty once
+ * the cached CRCs (crcs_written) and the data are durable on the legs
+ */
+static void pretty_bitmap_exit(bool crcs_written)
+{
+	unsigned long region;
+	bool clear;
+
+	if (!pretty_dev.bitmap_shift)
+		return;
+
+	cancel_delayed_work_sync(&bitmap.clear);
+	wait_event(bitmap.idle, !READ_ONCE(bitmap.busy));
+
+	clear = crcs_written && pretty_bitmap_flush_legs();
+
+	spin_lock(&bitmap.lock);
+	for_each_set_bit(region, bitmap.wanted, bitmap.nr_regions)
+		if (clear && !pretty_degraded() && (!bitmap.resync || !test_bit(region, bitmap.resync)))
+			pretty_bitmap_set(region, false);
+	bitmap.busy = true;
+	spin_unlock(&bitmap.lock);
+
+	pretty_bitmap_issue();
+	wait_event(bitmap.idle, !READ_ONCE(bitmap.busy));
+
+	pretty_bitmap_free();
+}
+
+/* Flushes are coalesced: the bios that ask for one while none is running
+ * share the next flush of the legs, those that arrive while it runs wait for
+ * the one after, since it may have started before their earlier writes
+ * completed. With many fsyncs in flight every leg sees about one flush per
+ * flush latency instead of one per bio.
+ */
+static struct pretty_flush {
+	spinlock_t lock;
+	struct list_head waiters;									// bios for the next flush
+	struct list_head running;									// bios covered by the flush in flight
+	bool busy;
+
+	struct work_struct work;
+	atomic_t pending;
+	blk_status_t status;
+
+	atomic_long_t requests, issued;
+} flush;
+
+static void pretty_flush_endio(struct bio *bio)
+{
+	int leg = pretty_leg(bio->bi_disk);
+
+	if (bio->bi_status && (WARN_ON_ONCE(leg < 0) || !pretty_leg_fail(leg)))
+		flush.status = bio->bi_status;
+
+	if (leg >= 0)
+		pretty_leg_dec(leg);
+	bio_put(bio);
+	if (atomic_dec_and_test(&flush.pending))
+		queue_work(pretty_dev.queue, &flush.work);
+}
+
+/* one empty PREFLUSH bio per leg for every bio waiting so far */
+static void pretty_flush_issue(void)
+{
+	unsigned long legs = pretty_writable_legs();
+	struct bio *bio;
+	int leg;
+
+	spin_lock(&flush.lock);
+	list_splice_init(&flush.waiters, &flush.running);
+	spin_unlock(&flush.lock);
+
+	flush.status = BLK_STS_OK;
+	atomic_set(&flush.pending, hweight_long(legs));
+	atomic_long_inc(&flush.issued);
+
+	for_each_set_bit(leg, &legs, pretty_dev.nr_legs) {
+		bio = bio_alloc_bioset(GFP_NOIO, 0, &pretty_dev.io_bio_set);
+		bio->bi_disk = pretty_leg_disk(leg);
+		bio->bi_opf = REQ_OP_WRITE | REQ_PREFLUSH;
+		bio->bi_end_io = pretty_flush_endio;
+		atomic_inc(&pretty_dev.inflight[leg]);
+		submit_bio(bio);
+	}
+}
+
+static void pretty_flush_done(struct work_struct *work)
+{
+	struct pretty_bio *pb, *tmp;
+	bool again;
+
+	list_for_each_entry_safe(pb, tmp, &flush.running, wait_node) {
+		list_del(&pb->wait_node);
+		if (flush.status)
+			pb->io_status = flush.status;
+		queue_work(pretty_dev.queue, &pb->work);
+	}
+
+	spin_lock(&flush.lock);
+	again = !list_empty(&flush.waiters);
+	flush.busy = again;
+	spin_unlock(&flush.lock);
+
+	if (again)
+		pretty_flush_issue();
+}
+
+/* run next once every write completed before this call is durable on every leg */
+static void pretty_flush_wait(struct pretty_bio *pb, void (*next)(struct pretty_bio *pb))
+{
+	bool start;
+
+	pb->next = next;
+	atomic_long_inc(&flush.requests);
+
+	spin_lock(&flush.lock);
+	list_add_tail(&pb->wait_node, &flush.waiters);
+	start = !flush.busy;
+	flush.busy = true;
+	spin_unlock(&flush.lock);
+
+	if (start)
+		pretty_flush_issue();
+}
+
+/* the cached CRCs are durable, now the legs; an empty flush or a flush
+ * request of the blk-mq front end is done then, a write goes on without
+ * sending the flush to the legs again
+ */
+static void pretty_flush_legs(struct pretty_bio *pb)
+{
+	if (!pb->bio || !pb->bio->bi_iter.bi_size) {
+		pretty_flush_wait(pb, pretty_write_crc_done);
+		return;
+	}
+
+	pb->bio->bi_opf &= ~REQ_PREFLUSH;
+	pretty_flush_wait(pb, pretty_write_start);
+}
+
+/* flush request of the blk-mq front end, it has no bio */
+static void pretty_flush_start(struct pretty_bio *pb)
+{
+	crc_cache_sync(pb, pretty_flush_legs);
+}
+
+static void pretty_flush_init(void)
+{
+	spin_lock_init(&flush.lock);
+	INIT_LIST_HEAD(&flush.waiters);
+	INIT_LIST_HEAD(&flush.running);
+	INIT_WORK(&flush.work, pretty_flush_done);
+}
+
+module_param_cb(flush_requests, &pretty_counter_ops, &flush.requests, 0444);
+module_param_cb(flush_issued, &pretty_counter_ops, &flush.issued, 0444);
+
+/* every kind of write, once its regions are dirty in the bitmap */
+static void pretty_write_begin(struct pretty_bio *pb)
+{
+	struct bio *my_bio = pb->bio;
+
+	/* blk-mq sent the PREFLUSH of a request as a flush request of its own,
+	 * see pretty_flush_start(), and cleared it from the request only
+	 */
+	if (pb->rq)
+		my_bio->bi_opf &= ~REQ_PREFLUSH;
+
+	if (bio_op(my_bio) == REQ_OP_DISCARD)
+		pretty_discard_start(pb);
+	else if (bio_op(my_bio) == REQ_OP_WRITE_ZEROES)
+		pretty_write_zeroes_start(pb);
+	else if (my_bio->bi_opf & REQ_PREFLUSH)
+		crc_cache_sync(pb, pretty_flush_legs);			// the cached CRCs are made durable first, then the legs
+	else
+		pretty_write_start(pb);
+}
+
+static void pretty_bio_start(struct pretty_bio *pb)
+{
+	struct bio *my_bio = pb->bio;
+
+	if (!pb->locked && my_bio->bi_iter.bi_size && !pretty_range_lock(pb))
+		return;														// restarted by pretty_range_unlock()
+
+	if (bio_data_dir(my_bio) == REQ_OP_WRITE) {
+		/* WRITE BIO */
+		pretty_bitmap_mark(pb, pretty_write_begin);
+	} else {
+		/* READ BIO */
+		pretty_read_start(pb);
+	}
+}
+
+static int pretty_block_open(struct block_device *bdev, fmode_t mode)
+{
+	return 0;
+}
+
+static void pretty_block_release(struct gendisk *gd, fmode_t mode)
+{
+}
+
+static struct pretty_bio *pretty_bio_alloc(struct bio *bio, gfp_t gfp)
+{
+	struct pretty_bio *pb = pretty_bio_get(gfp);
+
+	pb->bio = bio;
+	pb->next = pretty_bio_start;
+	if (bio->bi_iter.bi_size)
+		locate_crc_range(pb);
+
+	return pb;
+}
+
+/* Scrub and resync chunks enter the queue of the array like the bios
+ * submitted to it, they wait while pretty_leg_swap() holds it frozen.
+ */
+static void pretty_queue_enter(struct pretty_bio *pb)
+{
+	struct request_queue *q = pretty_dev.gd->queue;
+
+	wait_event(q->mq_freeze_wq, percpu_ref_tryget_live(&q->q_usage_counter));
+	pb->queue_ref = true;
+}
+
+static blk_qc_t pretty_submit_bio(struct bio *bio)
+{
+	struct pretty_bio *new_bio;
+
+	/* keep the bio within what the reserves are sized for */
+	blk_queue_split(&bio);
+
+	new_bio = pretty_bio_alloc(bio, GFP_NOIO);
+
+	/* the queue stays entered until the bio completes like a request does,
+	 * so that freezing it waits for every stage, see pretty_leg_swap()
+	 */
+	percpu_ref_get(&bio->bi_disk->queue->q_usage_counter);
+	new_bio->queue_ref = true;
+
+	WRITE_ONCE(pretty_dev.last_io, jiffies);
+
+	/* add work to queue */
+	queue_work(pretty_dev.queue, &new_bio->work);
+
+	return BLK_QC_T_NONE;
+}
+
+/* Optional blk-mq front end: the block layer plugs and merges bios into
+ * requests and calls pretty_queue_rq() on the submitting CPU. The queue is
+ * blocking, so the first stage of every bio runs right there and only the
+ * later stages go through the workqueue.
+ */
+static bool use_mq;
+static bool mq_per_node;
+
+module_param(use_mq, bool, 0444);
+MODULE_PARM_DESC(use_mq, "Request-based blk-mq front end instead of bio-based (default false)");
+module_param(mq_per_node, bool, 0444);
+MODULE_PARM_DESC(mq_per_node, "One blk-mq hardware queue per NUMA node instead of per CPU (default false)");
+
+static blk_status_t pretty_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+	struct request *rq = bd->rq;
+	struct pretty_rq *prq = blk_mq_rq_to_pdu(rq);
+	struct pretty_bio *pb;
+	struct bio *bio;
+
+	blk_mq_start_request(rq);
+
+	atomic_set(&prq->pending, 1);
+	prq->status = BLK_STS_OK;
+
+	WRITE_ONCE(pretty_dev.last_io, jiffies);
+
+	/* the flush sequence of blk-mq sends PREFLUSH as a request of its own */
+	if (req_op(rq) == REQ_OP_FLUSH) {
+		pb = pretty_bio_get(GFP_NOIO);
+		pb->rq = rq;
+		pb->next = pretty_flush_start;
+
+		atomic_inc(&prq->pending);
+		work_handler(&pb->work);
+	}
+
+	__rq_for_each_bio(bio, rq) {
+		pb = pretty_bio_alloc(bio, GFP_NOIO);
+		pb->rq = rq;
+
+		atomic_inc(&prq->pending);
+		work_handler(&pb->work);
+	}
+
+	pretty_rq_put(rq, BLK_STS_OK);
+
+	return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops pretty_mq_ops = {
+	.queue_rq = pretty_queue_rq,
+};
+
+static void pretty_scrub_endio(struct bio *bio)
+{
+	complete(bio->bi_private);
+}
+
+/* read one chunk of the logical disk through the read path and wait for it */
+static int pretty_scrub_chunk(unsigned long long sector, unsigned int nr_sectors)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct pretty_bio *pb;
+	struct bio *bio;
+	unsigned int i, len;
+	int err;
+
+	bio = bio_alloc(GFP_KERNEL, SCRUB_CHUNK_PAGES);
+	bio->bi_disk = pretty_dev.gd;
+	bio->bi_opf = REQ_OP_READ;
+	bio->bi_iter.bi_sector = sector;
+	bio->bi_private = &done;
+	bio->bi_end_io = pretty_scrub_endio;
+
+	len = nr_sectors * KERNEL_SECTOR_SIZE;
+	for (i = 0; len; i++) {
+		bio_add_page(bio, scrub.pages[i], min_t(unsigned int, len, PAGE_SIZE), 0);
+		len -= min_t(unsigned int, len, PAGE_SIZE);
+	}
+
+	pb = pretty_bio_alloc(bio, GFP_KERNEL);
+	pb->scrub = true;
+	pretty_queue_enter(pb);
+
+	queue_work(pretty_dev.queue, &pb->work);
+	wait_for_completion(&done);
+
+	err = blk_status_to_errno(bio->bi_status);
+	bio_put(bio);
+
+	return err;
+}
+
+static bool pretty_scrub_idle(void)
+{
+	return time_after_eq(jiffies, READ_ONCE(pretty_dev.last_io) + msecs_to_jiffies(READ_ONCE(scrub_idle_ms)));
+}
+
+static int pretty_scrub_thread(void *data)
+{
+	unsigned long long sector;
+	unsigned long start, elapsed_ms, budget_ms;
+	unsigned int nr_sectors, kbps;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(scrub.wait, kthread_should_stop() || READ_ONCE(scrub.state) == SCRUB_RUNNING);
+		if (kthread_should_stop())
+			break;
+
+		/* foreground I/O goes first */
+		if (!pretty_scrub_idle()) {
+			schedule_timeout_interruptible(msecs_to_jiffies(READ_ONCE(scrub_idle_ms)));
+			continue;
+		}
+
+		if (xchg(&scrub.restart, false))
+			atomic_long_set(&scrub.position, 0);
+
+		sector = atomic_long_read(&scrub.position);
+		if (sector >= pretty_dev.data_sectors) {
+			/* one pass per start */
+			atomic_long_inc(&scrub.passes);
+			cmpxchg(&scrub.state, SCRUB_RUNNING, SCRUB_STOPPED);
+			pr_info("scrub: pass done, %ld sectors repaired, %ld unrecoverable\n",
+				atomic_long_read(&scrub.repaired), atomic_long_read(&scrub.errors));
+			continue;
+		}
+
+		nr_sectors = min_t(unsigned long long, SCRUB_CHUNK_SECTORS, pretty_dev.data_sectors - sector);
+
+		start = jiffies;
+		if (pretty_scrub_chunk(sector, nr_sectors))
+			pr_err("scrub: sectors %llu-%llu could not be verified\n", sector, sector + nr_sectors - 1);
+		atomic_long_set(&scrub.position, sector + nr_sectors);
+
+		/* bandwidth cap: a chunk may not take less than its share of scrub_kbps */
+		kbps = READ_ONCE(scrub_kbps);
+		if (kbps) {
+			budget_ms = (unsigned long)nr_sectors * 500 / kbps;
+			elapsed_ms = jiffies_to_msecs(jiffies - start);
+			if (budget_ms > elapsed_ms)
+				schedule_timeout_interruptible(msecs_to_jiffies(budget_ms - elapsed_ms));
+		}
+	}
+
+	return 0;
+}
+
+static int scrub_set(const char *val, const struct kernel_param *kp)
+{
+	int state = sysfs_match_string(scrub_command_names, val);
+
+	if (state < 0)
+		return state;
+
+	/* start after a stop or a finished pass begins a new pass, after a pause it resumes */
+	if (state == SCRUB_STOPPED || (state == SCRUB_RUNNING && READ_ONCE(scrub.state) == SCRUB_STOPPED))
+		WRITE_ONCE(scrub.restart, true);
+	WRITE_ONCE(scrub.state, state);
+	wake_up(&scrub.wait);
+
+	return 0;
+}
+
+static int scrub_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%s\n", scrub_state_names[READ_ONCE(scrub.state)]);
+}
+
+static const struct kernel_param_ops scrub_ops = {
+	.set = scrub_set,
+	.get = scrub_get,
+};
+
+module_param_cb(scrub, &scrub_ops, &scrub.state, 0644);
+MODULE_PARM_DESC(scrub, "Background scrubber: start, stop or pause");
+module_param(scrub_kbps, uint, 0644);
+MODULE_PARM_DESC(scrub_kbps, "Bandwidth cap of the scrubber in KiB/s, 0 means no cap (default 8192)");
+module_param(scrub_idle_ms, uint, 0644);
+MODULE_PARM_DESC(scrub_idle_ms, "Idle time of /dev/ssr before the scrubber runs (default 200)");
+module_param_cb(scrub_position, &pretty_counter_ops, &scrub.position, 0444);
+module_param_cb(scrub_sectors, &pretty_counter_ops, &scrub.sectors, 0444);
+module_param_cb(scrub_repaired, &pretty_counter_ops, &scrub.repaired, 0444);
+module_param_cb(scrub_errors, &pretty_counter_ops, &scrub.errors, 0444);
+module_param_cb(scrub_passes, &pretty_counter_ops, &scrub.passes, 0444);
+
+static int pretty_scrub_init(void)
+{
+	int i;
+
+	init_waitqueue_head(&scrub.wait);
+
+	for (i = 0; i < SCRUB_CHUNK_PAGES; i++) {
+		scrub.pages[i] = alloc_page(GFP_KERNEL);
+		if (!scrub.pages[i])
+			goto out_free_pages;
+	}
+
+	scrub.task = kthread_run(pretty_scrub_thread, NULL, "pretty_scrub");
+	if (IS_ERR(scrub.task))
+		goto out_free_pages;
+
+	return 0;
+
+out_free_pages:
+	while (i--)
+		__free_page(scrub.pages[i]);
+	return -ENOMEM;
+}
+
+static void pretty_scrub_exit(void)
+{
+	int i;
+
+	/* a chunk in flight is finished first */
+	kthread_stop(scrub.task);
+
+	for (i = 0; i < SCRUB_CHUNK_PAGES; i++)
+		__free_page(scrub.pages[i]);
+}
+
+/* Full resync, started by SSR_IOCTL_SYNC or the resync parameter: a kernel
+ * thread walks the logical disk in chunks with resync_depth of them in flight.
+ * A chunk is read from the first leg with its CRCs and, when every block
+ * checks out, written as is to the other legs with the CRC range, so a
+ * healthy mirror costs one read and one write per leg and nothing else. A
+ * chunk with a bad block or a read error goes through the read path instead,
+ * which finds the good copy of every block and repairs all the legs.
+ * Unlike the scrubber it runs at full speed and does not wait for idle time.
+ * The same pass rebuilds a leg put back into the array, see pretty_leg_re_add(),
+ * and that one is throttled: it goes at up to rebuild_max_kbps while /dev/ssr
+ * is idle and drops to rebuild_min_kbps as soon as foreground I/O comes in.
+ */
+enum {
+	RESYNC_IDLE,
+	RESYNC_RUNNING,
+};
+
+static const char * const resync_state_names[] = {
+	[RESYNC_IDLE] = "idle",
+	[RESYNC_RUNNING] = "running",
+};
+
+/* commands accepted by the resync parameter */
+enum {
+	RESYNC_START,
+	RESYNC_CANCEL,
+};
+
+static const char * const resync_command_names[] = {
+	[RESYNC_START] = "start",
+	[RESYNC_CANCEL] = "cancel",
+};
+
+#define RESYNC_MAX_DEPTH		8
+
+static unsigned int resync_depth = 4;
+static unsigned int rebuild_min_kbps = 1024;
+static unsigned int rebuild_max_kbps;
+
+static struct pretty_resync {
+	struct task_struct *task;
+	wait_queue_head_t wait;
+	struct page *pages[RESYNC_MAX_DEPTH][SCRUB_CHUNK_PAGES];	// one buffer per chunk in flight
+	unsigned long busy;										// buffers of the chunks in flight
+	struct mutex lock;										// serialises the starts
+	int state;
+	bool cancel;
+	bool dirty_only;										// only the regions to resync in the bitmap
+	unsigned long rebuild;									// legs active once the pass completes
+	ktime_t start;
+
+	atomic_long_t position, sectors, errors, kbps;
+} resync;
+
+/* rebuilt legs are read again, those of a failed or cancelled pass are dropped */
+static void pretty_legs_rebuilt(unsigned long legs, bool ok)
+{
+	spin_lock_irq(&pretty_dev.leg_lock);
+	legs &= pretty_dev.rebuilding;
+	WRITE_ONCE(pretty_dev.rebuilding, pretty_dev.rebuilding & ~legs);
+	if (ok)
+		WRITE_ONCE(pretty_dev.active, pretty_dev.active | legs);
+	spin_unlock_irq(&pretty_dev.leg_lock);
+
+	if (legs) {
+		pr_info("legs %#lx %s\n", legs, ok ? "rebuilt" : "not rebuilt, still failed");
+		pretty_sb_changed(false);
+	}
+}
+
+static void pretty_resync_done(struct pretty_bio *pb)
+{
+	if (pb->io_status)
+		pb->err = 1;
+
+	pretty_bio_complete(pb);
+}
+
+static void pretty_resync_copy(struct pretty_bio *pb)
+{
+	unsigned long long first_sector = pb->bio->bi_iter.bi_sector;
+	bool good;
+	unsigned int k;
+
+	if (pb->crc_pages && pretty_crc_range_retry(pb))
+		return;
+
+	good = pb->io_status == BLK_STS_OK && pb->crc_status == BLK_STS_OK;
+	if (good && pb->crc_from_disk)
+		crc_cache_merge(pb, pb->crc_pages);
+
+	if (good && pb->crc_pages) {
+		compute_crc_bio(pb->bio, pb->checksums, pb->gather);
+
+		for (k = 0; k < pb->nr_blocks && good; k++)
+			good = get_crc_from_range(pb, pb->crc_pages, first_sector + (k << pretty_dev.csum_shift)) ==
+			       pb->checksums[k];
+	}
+
+	if (!good) {
+		/* BAD BLOCK OR READ ERROR ON THE FIRST LEG => the read path repairs block by block */
+		free_crc_pages(pb, pb->crc_pages);
+		pb->crc_pages = NULL;
+		pretty_free_blocks(pb);
+		pb->crc_from_disk = false;
+		pb->crc_status = BLK_STS_OK;
+		pb->crc_legs = 0;
+		pb->io_status = BLK_STS_OK;
+		pretty_read_start(pb);
+		return;
+	}
+
+	/* the first leg is good, copy the data and its CRCs to the others */
+	pretty_resync_write(pb, pretty_writable_legs() & ~BIT(pb->primary));
+}
+
+/* the good data of the chunk and its CRCs go to legs */
+static void pretty_resync_write(struct pretty_bio *pb, unsigned long legs)
+{
+	struct bio *clone;
+	int leg;
+
+	pb->next = pretty_resync_done;
+	for_each_set_bit(leg, &legs, pretty_dev.nr_legs) {
+		clone = bio_clone_fast(pb->bio, GFP_NOIO, &pretty_dev.io_bio_set);
+		clone->bi_disk = pretty_leg_disk(leg);
+		clone->bi_opf = REQ_OP_WRITE;
+		pretty_io_submit(pb, clone);
+
+		if (pb->crc_pages)
+			modify_crc_range_on_disk(pb, pretty_leg_disk(leg), pb->crc_pages);
+	}
+	pretty_io_put(pb);
+}
+
+static void pretty_resync_start(struct pretty_bio *pb)
+{
+	if (!pb->locked && !pretty_range_lock(pb))
+		return;														// restarted by pretty_range_unlock()
+
+	if (!pretty_reserve(pb, 1, bio_sectors(pb->bio) >> pretty_dev.csum_shift, pretty_resync_start))
+		return;
+
+	pretty_read_set_legs(pb, pretty_first_leg());
+	pb->next = pretty_resync_copy;
+	retransmit_bio_data_on_disk(pb, pretty_leg_disk(pb->primary), pb->bio);
+
+	pretty_load_crc_range(pb, false);
+
+	pretty_io_put(pb);
+}
+
+static void pretty_resync_endio(struct bio *bio)
+{
+	unsigned long slot = (unsigned long)bio->bi_private;
+	s64 ms;
+
+	if (bio->bi_status) {
+		atomic_long_inc(&resync.errors);
+		pr_err_ratelimited("resync: sectors %llu-%llu could not be synchronised\n",
+				   (unsigned long long)bio->bi_iter.bi_sector, bio_end_sector(bio) - 1);
+	}
+
+	atomic_long_add(bio_sectors(bio), &resync.sectors);
+	ms = ktime_ms_delta(ktime_get(), resync.start);
+	if (ms > 0)
+		atomic_long_set(&resync.kbps, atomic_long_read(&resync.sectors) / 2 * 1000 / ms);
+
+	bio_put(bio);
+	clear_bit(slot, &resync.busy);
+	wake_up(&resync.wait);
+}
+
+static void pretty_resync_chunk(unsigned long slot, unsigned long long sector, unsigned int nr_sectors)
+{
+	struct pretty_bio *pb;
+	struct bio *bio;
+	unsigned int i, len;
+
+	bio = bio_alloc(GFP_KERNEL, SCRUB_CHUNK_PAGES);
+	bio->bi_disk = pretty_dev.gd;
+	bio->bi_opf = REQ_OP_READ;
+	bio->bi_iter.bi_sector = sector;
+	bio->bi_private = (void *)slot;
+	bio->bi_end_io = pretty_resync_endio;
+
+	len = nr_sectors * KERNEL_SECTOR_SIZE;
+	for (i = 0; len; i++) {
+		bio_add_page(bio, resync.pages[slot][i], min_t(unsigned int, len, PAGE_SIZE), 0);
+		len -= min_t(unsigned int, len, PAGE_SIZE);
+	}
+
+	pb = pretty_bio_alloc(bio, GFP_KERNEL);
+	pb->resync = true;
+	pretty_queue_enter(pb);
+	pb->next = pretty_resync_start;
+
+	queue_work(pretty_dev.queue, &pb->work);
+}
+
+static void pretty_resync_free_pages(void)
+{
+	int slot, i;
+
+	for (slot = 0; slot < RESYNC_MAX_DEPTH; slot++)
+		for (i = 0; i < SCRUB_CHUNK_PAGES; i++) {
+			if (resync.pages[slot][i])
+				__free_page(resync.pages[slot][i]);
+			resync.pages[slot][i] = NULL;
+		}
+}
+
+/* the buffers are only held while a resync runs */
+static int pretty_resync_alloc_pages(unsigned int depth)
+{
+	int slot, i;
+
+	for (slot = 0; slot < depth; slot++)
+		for (i = 0; i < SCRUB_CHUNK_PAGES; i++) {
+			resync.pages[slot][i] = alloc_page(GFP_KERNEL);
+			if (!resync.pages[slot][i]) {
+				pretty_resync_free_pages();
+				return -ENOMEM;
+			}
+		}
+
+	return 0;
+}
+
+/* Rebuild bandwidth: the chunks are sent no faster than the floor while
+ * foreground I/O came in during the last scrub_idle_ms, no faster than the
+ * ceiling otherwise. A floor of 0 pauses the rebuild while /dev/ssr is busy,
+ * a ceiling of 0 lets it run at full speed when idle.
+ */
+static void pretty_resync_throttle(unsigned int nr_sectors, unsigned long *last)
+{
+	unsigned long budget_ms, elapsed_ms;
+	unsigned int kbps;
+
+	while (!pretty_scrub_idle() && !READ_ONCE(rebuild_min_kbps) &&
+	       !READ_ONCE(resync.cancel) && !kthread_should_stop())
+		schedule_timeout_interruptible(msecs_to_jiffies(READ_ONCE(scrub_idle_ms)));
+
+	kbps = pretty_scrub_idle() ? READ_ONCE(rebuild_max_kbps) : READ_ONCE(rebuild_min_kbps);
+	if (kbps) {
+		budget_ms = (unsigned long)nr_sectors * 500 / kbps;
+		elapsed_ms = jiffies_to_msecs(jiffies - *last);
+		if (budget_ms > elapsed_ms)
+			schedule_timeout_interruptible(msecs_to_jiffies(budget_ms - elapsed_ms));
+	}
+	*last = jiffies;
+}
+
+static int pretty_resync_thread(void *data)
+{
+	unsigned long long sector;
+	unsigned int nr_sectors, depth;
+	unsigned long slot, last;
+	bool done;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(resync.wait, kthread_should_stop() || READ_ONCE(resync.state) == RESYNC_RUNNING);
+		if (kthread_should_stop())
+			break;
+
+		depth = clamp_t(unsigned int, READ_ONCE(resync_depth), 1, RESYNC_MAX_DEPTH);
+		if (pretty_resync_alloc_pages(depth)) {
+			pr_err("resync: out of memory\n");
+			WRITE_ONCE(resync.state, RESYNC_IDLE);
+			continue;
+		}
+
+		resync.start = ktime_get();
+		last = jiffies;
+		for (sector = 0; sector < pretty_dev.data_sectors; sector += nr_sectors) {
+			nr_sectors = min_t(unsigned long long, SCRUB_CHUNK_SECTORS, pretty_dev.data_sectors - sector);
+			if (resync.dirty_only && !pretty_bitmap_resync_needed(sector, nr_sectors))
+				continue;
+
+			/* wait for a free buffer, the chunks in flight keep the legs busy meanwhile */
+			wait_event(resync.wait, find_first_zero_bit(&resync.busy, depth) < depth);
+			if (READ_ONCE(resync.cancel) || kthread_should_stop())
+				break;
+
+			slot = find_first_zero_bit(&resync.busy, depth);
+			set_bit(slot, &resync.busy);
+
+			pretty_resync_chunk(slot, sector, nr_sectors);
+			atomic_long_set(&resync.position, sector + nr_sectors);
+
+			if (resync.rebuild)
+				pretty_resync_throttle(nr_sectors, &last);
+		}
+
+		wait_event(resync.wait, !READ_ONCE(resync.busy));
+		pretty_resync_free_pages();
+		done = sector >= pretty_dev.data_sectors;
+		if (done)
+			pretty_bitmap_resynced();
+
+		/* a leg with a chunk that could not be copied stays out */
+		if (resync.rebuild)
+			pretty_legs_rebuilt(resync.rebuild, done && !atomic_long_read(&resync.errors));
+
+		pr_info("resync: %s, %ld sectors at %ld KiB/s, %ld chunks failed\n",
+			done ? "done" : "cancelled", atomic_long_read(&resync.sectors),
+			atomic_long_read(&resync.kbps), atomic_long_read(&resync.errors));
+		WRITE_ONCE(resync.state, RESYNC_IDLE);
+	}
+
+	return 0;
+}
+
+/* the whole array, or only the regions dirty in the bitmap, writing to the
+ * rebuild legs as well
+ */
+static int pretty_resync_begin(bool dirty_only, unsigned long rebuild)
+{
+	int err = 0;
+
+	mutex_lock(&resync.lock);
+	if (READ_ONCE(resync.state) != RESYNC_IDLE) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	WRITE_ONCE(resync.cancel, false);
+	resync.dirty_only = dirty_only;
+	resync.rebuild = rebuild;
+	atomic_long_set(&resync.position, 0);
+	atomic_long_set(&resync.sectors, 0);
+	atomic_long_set(&resync.errors, 0);
+	atomic_long_set(&resync.kbps, 0);
+
+	/* written by every bio from now on, the chunks copy what came before */
+	if (rebuild) {
+		spin_lock_irq(&pretty_dev.leg_lock);
+		WRITE_ONCE(pretty_dev.rebuilding, pretty_dev.rebuilding | rebuild);
+		spin_unlock_irq(&pretty_dev.leg_lock);
+	}
+
+	WRITE_ONCE(resync.state, RESYNC_RUNNING);
+	wake_up(&resync.wait);
+
+out:
+	mutex_unlock(&resync.lock);
+
+	return err;
+}
+
+static int pretty_resync_command(int command)
+{
+	if (command == RESYNC_CANCEL) {
+		WRITE_ONCE(resync.cancel, true);
+		wake_up(&resync.wait);
+		return 0;
+	}
+
+	return pretty_resync_begin(false, 0);
+}
+
+static int resync_set(const char *val, const struct kernel_param *kp)
+{
+	int command = sysfs_match_string(resync_command_names, val);
+
+	if (command < 0)
+		return command;
+
+	return pretty_resync_command(command);
+}
+
+static int resync_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%s\n", resync_state_names[READ_ONCE(resync.state)]);
+}
+
+static const struct kernel_param_ops resync_ops = {
+	.set = resync_set,
+	.get = resync_get,
+};
+
+module_param_cb(resync, &resync_ops, &resync.state, 0644);
+MODULE_PARM_DESC(resync, "Full resync of the legs: start or cancel, same as SSR_IOCTL_SYNC");
+module_param(resync_depth, uint, 0644);
+MODULE_PARM_DESC(resync_depth, "Chunks of 1 MiB in flight during a resync, 1 to 8 (default 4)");
+module_param(rebuild_min_kbps, uint, 0644);
+MODULE_PARM_DESC(rebuild_min_kbps, "Rebuild bandwidth while /dev/ssr serves foreground I/O, 0 to pause it (default 1024)");
+module_param(rebuild_max_kbps, uint, 0644);
+MODULE_PARM_DESC(rebuild_max_kbps, "Rebuild bandwidth while /dev/ssr is idle, 0 for no limit (default 0)");
+module_param_cb(resync_position, &pretty_counter_ops, &resync.position, 0444);
+module_param_cb(resync_sectors, &pretty_counter_ops, &resync.sectors, 0444);
+module_param_cb(resync_errors, &pretty_counter_ops, &resync.errors, 0444);
+module_param_cb(resync_kbps, &pretty_counter_ops, &resync.kbps, 0444);
+
+static int pretty_resync_init(void)
+{
+	init_waitqueue_head(&resync.wait);
+	mutex_init(&resync.lock);
+
+	resync.task = kthread_run(pretty_resync_thread, NULL, "pretty_resync");
+	if (IS_ERR(resync.task))
+		return PTR_ERR(resync.task);
+
+	return 0;
+}
+
+static void pretty_resync_exit(void)
+{
+	/* the chunks in flight are finished first */
+	WRITE_ONCE(resync.cancel, true);
+	kthread_stop(resync.task);
+}
+
+/* the argument is a plain value, 32-bit callers go through the same handler */
+static int pretty_block_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case SSR_IOCTL_SYNC:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		return pretty_resync_command(arg == SSR_SYNC_CANCEL ? RESYNC_CANCEL : RESYNC_START);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Bios are processed by a pool of workers, per-CPU or unbound. A bio only
+ * waits for the bios that touch the same CRC sectors, see pretty_range_lock().
+ */
+static bool workers_unbound = true;
+static unsigned int max_workers;
+
+static int max_workers_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int n;
+	int err = kstrtouint(val, 0, &n);
+
+	if (err)
+		return err;
+	if (n > WQ_MAX_ACTIVE)
+		return -EINVAL;
+
+	WRITE_ONCE(max_workers, n);
+	if (pretty_dev.queue)
+		workqueue_set_max_active(pretty_dev.queue, n ? n : WQ_DFL_ACTIVE);
+
+	return 0;
+}
+
+static const struct kernel_param_ops max_workers_ops = {
+	.set = max_workers_set,
+	.get = param_get_uint,
+};
+
+module_param(workers_unbound, bool, 0444);
+MODULE_PARM_DESC(workers_unbound, "Process bios on unbound workers instead of the submitting CPU (default true)");
+module_param_cb(max_workers, &max_workers_ops, &max_workers, 0644);
+MODULE_PARM_DESC(max_workers, "Maximum number of bios processed at the same time, 0 for the workqueue default (default 0)");
+
+static const struct block_device_operations pretty_block_ops = {
+	.owner = THIS_MODULE,
+	.open = pretty_block_open,
+	.release = pretty_block_release,
+	.ioctl = pretty_block_ioctl,
+	.compat_ioctl = pretty_block_ioctl,
+	.submit_bio = pretty_submit_bio,
+};
+
+static const struct block_device_operations pretty_mq_block_ops = {
+	.owner = THIS_MODULE,
+	.open = pretty_block_open,
+	.release = pretty_block_release,
+	.ioctl = pretty_block_ioctl,
+	.compat_ioctl = pretty_block_ioctl,
+};
+
+static struct request_queue *create_mq_queue(struct pretty_block_dev *dev)
 {
-	unsigned long long crc_address;
+	struct request_queue *queue;
+	int err, leg;
+
+	/* enough tags to keep every leg busy with reads */
+	dev->tag_set.ops = &pretty_mq_ops;
+	dev->tag_set.nr_hw_queues = mq_per_node ? num_online_nodes() : num_online_cpus();
+	dev->tag_set.queue_depth = 0;
+	for (leg = 0; leg < dev->nr_legs; leg++)
+		if (dev->legs[leg])
+			dev->tag_set.queue_depth += blk_queue_depth(bdev_get_queue(dev->legs[leg]));
+	dev->tag_set.numa_node = NUMA_NO_NODE;
+	dev->tag_set.cmd_size = sizeof(struct pretty_rq);
+	dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+
+	err = blk_mq_alloc_tag_set(&dev->tag_set);
+	if (err)
+		return ERR_PTR(err);
 
-	crc_address = LOGICAL_DISK_SIZE + data_sector * sizeof(unsigned int);
-	*crc_sector = LOGICAL_DISK_SECTORS + data_sector / (KERNEL_SECTOR_SIZE / 4);
-	*crc_offset = crc_address - KERNEL_SECTOR_SIZE * (*crc_sector);
+	queue = blk_mq_init_queue(&dev->tag_set);
+	if (IS_ERR(queue)) {
+		blk_mq_free_tag_set(&dev->tag_set);
+		return queue;
+	}
+
+	return queue;
 }
 
-struct page *read_sector_crc_from_disk(struct gendisk *gd, unsigned long long crc_sector)
+static int create_block_device(struct pretty_block_dev *dev)
 {
-	struct bio *bio_sector_crc;
-	struct page *page_crc;
+	int err = 0;
+
+	/* initialize the gendisk structure */
+	dev->gd = alloc_disk(SSR_NUM_MINORS);
+	if (!dev->gd) {
+		pr_err("alloc_disk: failure\n");
+		err = -ENOMEM;
+		goto out;
+	}
+
+	dev->gd->major = SSR_MAJOR;
+	dev->gd->first_minor = SSR_FIRST_MINOR;
+	dev->gd->fops = use_mq ? &pretty_mq_block_ops : &pretty_block_ops;
+	dev->gd->private_data = dev;
+	dev->gd->queue = use_mq ? create_mq_queue(dev) : blk_alloc_queue(NUMA_NO_NODE);
+	if (IS_ERR_OR_NULL(dev->gd->queue)) {
+		pr_err("unable to allocate the request queue\n");
+		err = dev->gd->queue ? PTR_ERR(dev->gd->queue) : -ENOMEM;
+		dev->gd->queue = NULL;
+		goto out_put_disk;
+	}
+
+	/* bios and requests up to what the reserves are sized for */
+	blk_queue_max_hw_sectors(dev->gd->queue, PRETTY_MAX_SECTORS);
 
-	bio_sector_crc = bio_alloc(GFP_NOIO, 1);						// alloc bio to read sector
+	/* smaller writes take a read-modify-write of their checksum block */
+	blk_queue_physical_block_size(dev->gd->queue, CSUM_BLOCK_SIZE);
+	blk_queue_io_min(dev->gd->queue, CSUM_BLOCK_SIZE);
 
-	bio_sector_crc->bi_disk = gd;									// set gendisk
-	bio_sector_crc->bi_opf = 0;										// set operation type as READ
-	bio_sector_crc->bi_iter.bi_sector = crc_sector;					// set sector
+	/* volatile write cache with FUA, see pretty_flush_wait() */
+	blk_queue_write_cache(dev->gd->queue, true, true);
 
-	page_crc = alloc_page(GFP_NOIO);
+	/* the CRCs of a write are computed from its pages once the legs wrote
+	 * them, see compute_and_modify_crc_on_disks(): the pages must not change
+	 * until the bio completes
+	 */
+	if (dev->csum_size)
+		blk_queue_flag_set(QUEUE_FLAG_STABLE_WRITES, dev->gd->queue);
 
-	bio_add_page(bio_sector_crc, page_crc, KERNEL_SECTOR_SIZE, 0);
+	/* discards are tracked per checksum block, see pretty_discard_start() */
+	blk_queue_flag_set(QUEUE_FLAG_DISCARD, dev->gd->queue);
+	blk_queue_max_discard_sectors(dev->gd->queue, PRETTY_MAX_SECTORS);
+	dev->gd->queue->limits.discard_granularity = CSUM_BLOCK_SIZE;
+	blk_queue_max_write_zeroes_sectors(dev->gd->queue, pretty_write_zeroes_sectors());
 
-	submit_bio_wait(bio_sector_crc);								// submit bio
+	snprintf(dev->gd->disk_name, 4, "ssr");
+	set_capacity(dev->gd, dev->data_sectors);
+
+	add_disk(dev->gd);
 
-	bio_put(bio_sector_crc);
+	return 0;
 
-	return page_crc;
+out_put_disk:
+	put_disk(dev->gd);
+	dev->gd = NULL;
+out:
+	return err;
 }
 
-void modify_sector_crc_on_disk(struct gendisk *gd, struct page *page_crc, unsigned long long crc_sector)
+/* the legs of the array, any block devices: disks, partitions, brd or loop */
+static char *leg_paths[SSR_MAX_LEGS] = { PHYSICAL_DISK1_NAME, PHYSICAL_DISK2_NAME };
+static unsigned int nr_leg_paths = 2;
+
+module_param_array_named(legs, leg_paths, charp, &nr_leg_paths, 0444);
+MODULE_PARM_DESC(legs, "Comma separated legs of the mirror, 2 to 8 (default " PHYSICAL_DISK1_NAME "," PHYSICAL_DISK2_NAME ")");
+
+/* ERR_PTR() when the leg cannot be opened */
+static struct block_device *open_disk(char *name)
 {
-	struct bio *bio_sector_crc = bio_alloc(GFP_NOIO, 1);
+	struct block_device *bdev;
 
-	bio_sector_crc->bi_disk = gd;									 // set gendisk
-	bio_sector_crc->bi_opf = 1;                                      // set operation type as READ
-	bio_sector_crc->bi_iter.bi_sector = crc_sector;                  // set sector
-	bio_add_page(bio_sector_crc, page_crc, KERNEL_SECTOR_SIZE, 0);
+	bdev = blkdev_get_by_path(name, FMODE_READ | FMODE_WRITE | FMODE_EXCL, THIS_MODULE);
 
-	submit_bio_wait(bio_sector_crc);                                 // submit bio
+	return bdev;
+}
 
-	bio_put(bio_sector_crc);
+static void close_disk(struct block_device *bdev)
+{
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
 }
 
-unsigned int compute_crc(struct page *page, int len)
+/* an existing array starts degraded without the legs that cannot be opened */
+static int open_legs(void)
 {
-	unsigned int checksum;
-	char *buffer_data;
+	struct block_device *bdev;
+	int i;
 
-	buffer_data = kmap_atomic(page);
-	checksum = crc32(0, (unsigned char *)buffer_data + len, KERNEL_SECTOR_SIZE);
+	if (nr_leg_paths < 2) {
+		pr_err("a mirror needs at least 2 legs\n");
+		return -EINVAL;
+	}
 
-	kunmap_atomic(buffer_data);
+	for (i = 0; i < nr_leg_paths; i++) {
+		bdev = open_disk(leg_paths[i]);
+		pretty_dev.nr_legs++;
+		if (IS_ERR(bdev)) {
+			pr_err("unable to open %s: %ld\n", leg_paths[i], PTR_ERR(bdev));
+			continue;
+		}
+		pretty_dev.legs[i] = bdev;
+		pretty_dev.active |= BIT(i);
+	}
 
-	return checksum;
+	if (!pretty_dev.active)
+		return -ENODEV;
+
+	return 0;
 }
 
-void compute_and_modify_crc_on_disks(struct gendisk *gd1, struct gendisk *gd2, struct bio *my_bio)
+static void close_legs(void)
 {
-	struct bio_vec bvec;
-	struct bvec_iter i;
-
-	int j;
-	unsigned long long number_sectors_in_bvec;
-	unsigned long long crc_sector, crc_offset;
+	while (pretty_dev.nr_legs) {
+		pretty_dev.nr_legs--;
+		if (pretty_dev.legs[pretty_dev.nr_legs])
+			close_disk(pretty_dev.legs[pretty_dev.nr_legs]);
+		pretty_dev.legs[pretty_dev.nr_legs] = NULL;
+	}
+}
 
-	char *buffer_crc;
-	unsigned int checksum;
+/* Superblock: records the on-disk format of the array. It is written by a
+ * load with create=1 and read back by every later load, legs without one are
+ * arrays from before it existed and keep the original format.
+ */
+static bool create;
+static char *csum = "crc32";
+static unsigned int csum_block = KERNEL_SECTOR_SIZE;
+static unsigned int bitmap_region_kb = 4096;
+
+module_param(create, bool, 0444);
+MODULE_PARM_DESC(create, "Write a new superblock to every leg, in the format given by the other parameters");
+module_param(csum, charp, 0444);
+MODULE_PARM_DESC(csum, "Checksum algorithm of a new array: crc32, crc32c, xxhash64 or none (default crc32)");
+module_param(csum_block, uint, 0444);
+MODULE_PARM_DESC(csum_block, "Bytes covered by one checksum of a new array, a power of 2 from 512 to PAGE_SIZE (default 512)");
+module_param(bitmap_region_kb, uint, 0444);
+MODULE_PARM_DESC(bitmap_region_kb, "KiB per bit of the write-intent bitmap of a new array, a power of 2 from 64, 0 for none (default 4096)");
+
+/* without checksums there are no blocks to read-modify-write */
+static void pretty_sb_set_format(u32 alg, unsigned int block, unsigned long long data_sectors, unsigned int bitmap_shift)
+{
+	pretty_dev.csum_alg = alg;
+	pretty_dev.csum_size = csum_sizes[alg];
+	pretty_dev.csum_shift = pretty_dev.csum_size ? ilog2(block / KERNEL_SECTOR_SIZE) : 0;
+	pretty_dev.data_sectors = data_sectors;
+	pretty_dev.bitmap_shift = bitmap_shift;
+}
 
-	struct page *page_crc;
+static unsigned long long pretty_leg_sectors(struct block_device *bdev)
+{
+	return i_size_read(bdev->bd_inode) >> 9;
+}
 
-	bio_for_each_segment(bvec, my_bio, i) {
-		/* bvec.bv_len can be > KERNEL_SECTOR_SIZE => in one read, multiple adiacent sectors can be read =>
-		 * => itterate through each sector in a bvec_page and compute crc for each sector
-		 */
-		number_sectors_in_bvec = bvec.bv_len / KERNEL_SECTOR_SIZE;
+static unsigned long long pretty_sb_sector(struct block_device *bdev)
+{
+	return pretty_leg_sectors(bdev) - SSR_SB_SECTORS;
+}
 
-		for (j = 0; j < number_sectors_in_bvec; j++) {
-			checksum = compute_crc(bvec.bv_page, bvec.bv_offset + j * KERNEL_SECTOR_SIZE);
+/* size of a leg of the array: data, CRC area, bitmap and the superblock at the end */
+static unsigned long long pretty_leg_min_sectors(void)
+{
+	return CRC_AREA_END + BITMAP_SECTORS + SSR_SB_SECTORS;
+}
 
-			locate_crc_on_disks(i.bi_sector + j,  &crc_sector, &crc_offset);
+static unsigned long long pretty_smallest_leg(void)
+{
+	unsigned long long leg = ULLONG_MAX;
+	int i;
 
-			page_crc = read_sector_crc_from_disk(pretty_dev.phys_bdev_1->bd_disk, crc_sector);
+	for (i = 0; i < pretty_dev.nr_legs; i++)
+		if (pretty_dev.legs[i])
+			leg = min(leg, pretty_leg_sectors(pretty_dev.legs[i]));
 
-			buffer_crc = kmap_atomic(page_crc);
+	return leg;
+}
 
-			memcpy(buffer_crc + crc_offset, &checksum, sizeof(unsigned int));  // write new CRC in CRC page
+/* regions of a new array, at most what single page bitmap writes can cover */
+static unsigned int pretty_sb_bitmap_shift(void)
+{
+	unsigned long long leg = pretty_smallest_leg();
+	unsigned int shift;
 
-			kunmap_atomic(buffer_crc);
+	if (!bitmap_region_kb)
+		return 0;
 
-			modify_sector_crc_on_disk(pretty_dev.phys_bdev_1->bd_disk, page_crc, crc_sector);
-			modify_sector_crc_on_disk(pretty_dev.phys_bdev_2->bd_disk, page_crc, crc_sector);
+	shift = ilog2(bitmap_region_kb * 2);
+	while (DIV_ROUND_UP_ULL(leg, 1ULL << shift) > (unsigned long long)BITMAP_MAX_PAGES * BITMAP_BITS_PER_PAGE)
+		shift++;
 
-			__free_page(page_crc);
-		}
-	}
+	return shift;
 }
 
-void retransmit_bio_data_on_disk(struct gendisk *gd, struct bio *my_bio, int dir)
+/* Capacity of a new array: the smaller leg without the superblock and the
+ * bitmap, split between the data and its CRC area. With one CRC sector for
+ * every n data sectors, d + DIV_ROUND_UP(d, n) fits in the leg for
+ * d = (leg - 1) * n / (n + 1).
+ */
+static unsigned long long pretty_sb_data_sectors(void)
 {
-	struct bio *new_bio = bio_alloc(GFP_KERNEL, 1);                 // alloc bio
+	unsigned long long leg = pretty_smallest_leg(), n;
 
-	memcpy(new_bio, my_bio, sizeof(struct bio));
-	bio_copy_data(new_bio, my_bio);
-	new_bio->bi_disk = gd;											// set gendisk
-	new_bio->bi_iter.bi_sector = my_bio->bi_iter.bi_sector;         // set sector
-	new_bio->bi_opf = dir;                                          // set operation type
+	if (leg <= SSR_SB_SECTORS + CSUM_BLOCK_SECTORS)
+		return 0;
+	leg -= SSR_SB_SECTORS;
+
+	/* sized for a bitmap covering the whole leg, a bit more than needed */
+	if (pretty_dev.bitmap_shift)
+		leg -= DIV_ROUND_UP_ULL(DIV_ROUND_UP_ULL(leg, 1ULL << pretty_dev.bitmap_shift), KERNEL_SECTOR_SIZE * 8);
 
-	submit_bio_wait(new_bio);
+	if (!pretty_dev.csum_size)
+		return leg;
 
-	bio_put(new_bio);
+	n = DATA_SECTORS_PER_CRC_SECTOR;
+	return round_down(div64_u64((leg - 1) * n, n + 1), CSUM_BLOCK_SECTORS);
 }
 
-struct page *read_sector_data_from_disk(struct gendisk *gd, unsigned long long sector, int len)
+static int pretty_sb_io(struct block_device *bdev, struct page *page, int op)
 {
-	struct bio *bio_data_disk1;
-	struct page *page_data_disk1;
+	struct bio *bio;
+	int err;
 
-	bio_data_disk1 = bio_alloc(GFP_NOIO, 1);						// alloc bio to read sector data
+	if (pretty_leg_sectors(bdev) < SSR_SB_SECTORS)
+		return -ENOSPC;
 
-	bio_data_disk1->bi_disk = gd;									// set gendisk
-	bio_data_disk1->bi_opf = 0;										// set operation type as READ
-	bio_data_disk1->bi_iter.bi_sector = sector;						// set sector
+	/* superblock updates run while writes wait for them */
+	bio = bio_alloc(GFP_NOIO, 1);
+	bio->bi_disk = bdev->bd_disk;
+	bio->bi_opf = op;
+	bio->bi_iter.bi_sector = pretty_sb_sector(bdev);
+	bio_add_page(bio, page, SSR_SB_SECTORS * KERNEL_SECTOR_SIZE, 0);
 
-	page_data_disk1 = alloc_page(GFP_KERNEL);
+	err = submit_bio_wait(bio);
+	bio_put(bio);
 
-	bio_add_page(bio_data_disk1, page_data_disk1, len, 0);
+	return err;
+}
 
-	submit_bio_wait(bio_data_disk1);
+static u32 pretty_sb_crc(struct ssr_superblock *sb)
+{
+	u32 saved = sb->sb_crc, checksum;
 
-	bio_put(bio_data_disk1);
+	sb->sb_crc = 0;
+	checksum = crc32(0, (unsigned char *)sb, sizeof(*sb));
+	sb->sb_crc = saved;
 
-	return page_data_disk1;
+	return checksum;
 }
 
-void write_from_disk_to_disk(struct page *page_src_disk, struct gendisk *gd_dest, unsigned long long sector)
+static int pretty_sb_create(struct ssr_superblock *sb, struct page *page)
 {
-	struct bio *bio_disk_dest;
-	struct page *page_disk_dest;
-	char *buffer_disk_src, *buffer_disk_dest;
+	int alg = sysfs_match_string(csum_alg_names, csum);
+	int err = 0, leg;
+
+	if (alg < 0) {
+		pr_err("unknown checksum algorithm %s\n", csum);
+		return -EINVAL;
+	}
+
+	if (pretty_degraded()) {
+		pr_err("a new array needs all of its legs\n");
+		return -ENODEV;
+	}
 
-	bio_disk_dest = bio_alloc(GFP_NOIO, 1);							// alloc bio to read sector data
+	if (!is_power_of_2(csum_block) || csum_block < KERNEL_SECTOR_SIZE || csum_block > PAGE_SIZE) {
+		pr_err("invalid checksum block size %u\n", csum_block);
+		return -EINVAL;
+	}
+
+	if (bitmap_region_kb && (!is_power_of_2(bitmap_region_kb) || bitmap_region_kb < 64)) {
+		pr_err("invalid bitmap region size %u KiB\n", bitmap_region_kb);
+		return -EINVAL;
+	}
+
+	memset(sb, 0, SSR_SB_SECTORS * KERNEL_SECTOR_SIZE);
+	sb->magic = cpu_to_le64(SSR_SB_MAGIC);
+	sb->version = cpu_to_le32(SSR_SB_VERSION);
+	sb->csum_alg = cpu_to_le32(alg);
+	sb->csum_block = cpu_to_le32(csum_block);
+
+	pretty_sb_set_format(alg, csum_block, 0, pretty_sb_bitmap_shift());
+	sb->bitmap_shift = cpu_to_le32(pretty_dev.bitmap_shift);
+	sb->data_sectors = cpu_to_le64(pretty_sb_data_sectors());
+	if (!sb->data_sectors) {
+		pr_err("the legs are too small for an array\n");
+		return -ENOSPC;
+	}
 
-	bio_disk_dest->bi_disk = gd_dest;								// set gendisk
-	bio_disk_dest->bi_opf = 1;										// set operation type as WRITE
-	bio_disk_dest->bi_iter.bi_sector = sector;						// set sector
+	sb->failed_legs = 0;
+	sb->events = 0;
+	sb->degraded_events = 0;
+	generate_random_uuid(sb->uuid);
+	sb->sb_crc = cpu_to_le32(pretty_sb_crc(sb));
 
-	page_disk_dest = alloc_page(GFP_KERNEL);
+	for (leg = 0; leg < pretty_dev.nr_legs && !err; leg++)
+		err = pretty_sb_io(pretty_dev.legs[leg], page, REQ_OP_WRITE | REQ_FUA);
+	if (err)
+		pr_err("unable to write the superblock: %d\n", err);
 
-	bio_add_page(bio_disk_dest, page_disk_dest, KERNEL_SECTOR_SIZE, 0);
+	return err;
+}
 
-	/* copy data from src disk page sector into dest disk page sector */
-	buffer_disk_src = kmap_atomic(page_src_disk);
-	buffer_disk_dest = kmap_atomic(page_disk_dest);
+/* a version 1 superblock is taken as version 2 without identity, the load gives it one */
+static bool pretty_sb_upgrade(struct ssr_superblock *sb)
+{
+	__le32 *v1_crc = (__le32 *)((u8 *)sb + SSR_SB_V1_SIZE - sizeof(__le32));
+	u32 saved = le32_to_cpu(*v1_crc);
 
-	memcpy(buffer_disk_dest, buffer_disk_src, KERNEL_SECTOR_SIZE);
-	kunmap_atomic(buffer_disk_src);
-	kunmap_atomic(buffer_disk_dest);
+	*v1_crc = 0;
+	if (crc32(0, (unsigned char *)sb, SSR_SB_V1_SIZE) != saved)
+		return false;
 
-	submit_bio_wait(bio_disk_dest);
+	memset(sb->uuid, 0, sizeof(sb->uuid));
+	sb->degraded_events = 0;
+	sb->version = cpu_to_le32(SSR_SB_VERSION);
+	sb->sb_crc = cpu_to_le32(pretty_sb_crc(sb));
 
-	bio_put(bio_disk_dest);
-	__free_page(page_disk_dest);
+	return true;
 }
 
-void work_handler(struct work_struct *work)
+static bool pretty_sb_read(struct block_device *bdev, struct ssr_superblock *sb, struct page *page)
 {
-	struct pretty_bio *bio_struct = container_of(work, struct pretty_bio, work);
-	int err = 0, j;
+	if (pretty_sb_io(bdev, page, REQ_OP_READ) || le64_to_cpu(sb->magic) != SSR_SB_MAGIC)
+		return false;
 
-	struct bio *my_bio = bio_struct->bio;
+	if (le32_to_cpu(sb->version) == 1)
+		return pretty_sb_upgrade(sb);
 
-	struct page *page_data_disk1, *page_data_disk2, *page_crc_disk1, *page_crc_disk2;
-	unsigned long long data_sector, crc_sector, crc_offset, number_sectors_in_bvec;
-	unsigned int checksum_disk1, checksum_disk2;
+	return le32_to_cpu(sb->version) == SSR_SB_VERSION && le32_to_cpu(sb->sb_crc) == pretty_sb_crc(sb);
+}
 
-	char *initial_buffer, *buffer_data_disk1, *buffer_data_disk2, *buffer_crc_disk1, *buffer_crc_disk2;
+/* Every leg is read and the superblock with the highest events wins: the
+ * legs it records as failed, those with an older or no superblock and those
+ * missing are left out of the array until they are rebuilt.
+ */
+static int pretty_sb_read_legs(struct ssr_superblock *sb, struct page *page)
+{
+	struct page *tmp = alloc_page(GFP_KERNEL);
+	struct ssr_superblock *leg_sb;
+	unsigned long current_legs = 0;
+	u64 events = 0;
+	int leg;
+
+	if (!tmp)
+		return -ENOMEM;
+	leg_sb = page_address(tmp);
+
+	for (leg = 0; leg < pretty_dev.nr_legs; leg++) {
+		if (!pretty_dev.legs[leg] || !pretty_sb_read(pretty_dev.legs[leg], leg_sb, tmp))
+			continue;
+
+		if (!current_legs || le64_to_cpu(leg_sb->events) > events) {
+			memcpy(sb, leg_sb, sizeof(*sb));
+			events = le64_to_cpu(sb->events);
+			current_legs = 0;
+		}
+		if (le64_to_cpu(leg_sb->events) == events)
+			current_legs |= BIT(leg);
+	}
+	__free_page(tmp);
 
-	int dir = bio_data_dir(my_bio);
+	/* array from before the superblock */
+	if (!current_legs)
+		return -ENOENT;
 
-	if (dir == REQ_OP_WRITE) {
-		/* WRITE BIO */
-		retransmit_bio_data_on_disk(pretty_dev.phys_bdev_1->bd_disk, my_bio, dir);
-		retransmit_bio_data_on_disk(pretty_dev.phys_bdev_2->bd_disk, my_bio, dir);
+	pretty_dev.active &= current_legs & ~(unsigned long)le32_to_cpu(sb->failed_legs);
+	if (!pretty_dev.active) {
+		pr_err("no current leg left\n");
+		return -ENODEV;
+	}
 
-		compute_and_modify_crc_on_disks(pretty_dev.phys_bdev_1->bd_disk, pretty_dev.phys_bdev_2->bd_disk, my_bio);
+	/* the legs left out, or the identity of an upgraded superblock, are
+	 * recorded before anything is written
+	 */
+	if (!memchr_inv(sb->uuid, 0, sizeof(sb->uuid))) {
+		generate_random_uuid(sb->uuid);
+		pretty_dev.sb_changed = true;
+		pretty_dev.sb_pending = true;
+	}
+	if (pretty_dev.active != (GENMASK(pretty_dev.nr_legs - 1, 0) & ~(unsigned long)le32_to_cpu(sb->failed_legs))) {
+		pretty_dev.sb_changed = true;
+		pretty_dev.sb_pending = true;
+	}
+	pretty_dev.sb_page = page;
+
+	return 0;
+}
 
+static int pretty_sb_load(void)
+{
+	struct ssr_superblock *sb;
+	struct page *page;
+	unsigned int block;
+	int err = 0, leg;
+	u32 alg;
+
+	page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (!page)
+		return -ENOMEM;
+	sb = page_address(page);
+
+	if (create) {
+		err = pretty_sb_create(sb, page);
+		if (!err)
+			pretty_dev.sb_page = page;
 	} else {
-		/* READ BIO */
-		struct bio_vec bvec;
-		struct bvec_iter i;
+		err = pretty_sb_read_legs(sb, page);
+	}
+
+	if (err == -ENOENT) {
+		/* array from before the superblock: a missing leg would come back
+		 * stale on the next load without anything telling it apart
+		 */
+		err = 0;
+		if (pretty_degraded()) {
+			pr_err("an array without superblock cannot start without all of its legs\n");
+			err = -ENODEV;
+		}
+		sb->csum_alg = cpu_to_le32(SSR_CSUM_CRC32);
+		sb->csum_block = 0;
+		sb->data_sectors = 0;
+		sb->bitmap_shift = 0;
+	}
+
+	alg = le32_to_cpu(sb->csum_alg);
+	if (!err && alg >= SSR_CSUM_NR) {
+		pr_err("unsupported checksum algorithm %u\n", alg);
+		err = -EINVAL;
+	}
+
+	/* 0 in the superblocks written before it was configurable */
+	block = le32_to_cpu(sb->csum_block) ?: KERNEL_SECTOR_SIZE;
+	if (!err && (!is_power_of_2(block) || block < KERNEL_SECTOR_SIZE || block > PAGE_SIZE)) {
+		pr_err("unsupported checksum block size %u\n", block);
+		err = -EINVAL;
+	}
+	if (!err && le32_to_cpu(sb->bitmap_shift) >= 48) {
+		pr_err("unsupported bitmap region shift %u\n", le32_to_cpu(sb->bitmap_shift));
+		err = -EINVAL;
+	}
+	if (!err)
+		pretty_sb_set_format(alg, block, le64_to_cpu(sb->data_sectors) ?: LOGICAL_DISK_SECTORS,
+				     le32_to_cpu(sb->bitmap_shift));
+
+	for (leg = 0; leg < pretty_dev.nr_legs && !err; leg++) {
+		if (pretty_dev.legs[leg] && pretty_leg_sectors(pretty_dev.legs[leg]) < pretty_leg_min_sectors()) {
+			pr_err("leg %d is smaller than the array (%llu sectors)\n", leg, pretty_dev.data_sectors);
+			err = -ENOSPC;
+		}
+	}
+
+	if (err || page != pretty_dev.sb_page) {
+		pretty_dev.sb_page = NULL;
+		__free_page(page);
+	}
 
-		bio_for_each_segment(bvec, my_bio, i) {
-			/* read data from disk1 */
-			page_data_disk1 = read_sector_data_from_disk(pretty_dev.phys_bdev_1->bd_disk, i.bi_sector, bvec.bv_len);
+	return err;
+}
 
-			/* bvec.bv_len can be > KERNEL_SECTOR_SIZE => in one read, multiple adiacent sectors can be read =>
-			 * => itterate through each sector in a bvec_page and compute crc for each sector
-			 */
-			number_sectors_in_bvec = bvec.bv_len / KERNEL_SECTOR_SIZE;
+/* record the failed legs on the others, then let the bios waiting for it complete */
+static void pretty_sb_update(struct work_struct *work)
+{
+	struct ssr_superblock *sb;
+	struct pretty_bio *pb, *tmp;
+	unsigned long legs, failed;
+	LIST_HEAD(waiters);
+	bool changed;
+	int leg;
+
+	spin_lock_irq(&pretty_dev.leg_lock);
+	changed = pretty_dev.sb_changed;
+	pretty_dev.sb_changed = false;
+	legs = pretty_dev.active | pretty_dev.rebuilding;
+	failed = GENMASK(pretty_dev.nr_legs - 1, 0) & ~pretty_dev.active;
+	spin_unlock_irq(&pretty_dev.leg_lock);
+
+	/* the legs of an array from before the superblock cannot be told apart */
+	if (changed && pretty_dev.sb_page) {
+		sb = page_address(pretty_dev.sb_page);
+		/* the bitmap stops being cleared from here, see pretty_leg_is_member() */
+		if (failed && !sb->failed_legs)
+			sb->degraded_events = sb->events;
+		sb->failed_legs = cpu_to_le32(failed);
+		le64_add_cpu(&sb->events, 1);
+		sb->sb_crc = cpu_to_le32(pretty_sb_crc(sb));
+
+		for_each_set_bit(leg, &legs, pretty_dev.nr_legs) {
+			if (!pretty_sb_io(pretty_dev.legs[leg], pretty_dev.sb_page, REQ_OP_WRITE | REQ_FUA))
+				continue;
+			pr_err("unable to write the superblock of leg %d\n", leg);
+			pretty_leg_fail(leg);
+		}
+	}
 
-			for (j = 0; j < number_sectors_in_bvec; j++) {
-				checksum_disk1 = compute_crc(page_data_disk1, j * KERNEL_SECTOR_SIZE);
+	/* a leg failed meanwhile, this work runs again first */
+	spin_lock_irq(&pretty_dev.leg_lock);
+	if (!pretty_dev.sb_changed) {
+		pretty_dev.sb_pending = false;
+		list_splice_init(&pretty_dev.sb_waiters, &waiters);
+	}
+	spin_unlock_irq(&pretty_dev.leg_lock);
 
-				data_sector = i.bi_sector + j;
-				locate_crc_on_disks(data_sector,  &crc_sector, &crc_offset);
+	list_for_each_entry_safe(pb, tmp, &waiters, wait_node) {
+		list_del(&pb->wait_node);
+		queue_work(pretty_dev.queue, &pb->work);
+	}
+}
 
-				/* read crc sector from disk1 */
-				page_crc_disk1 = read_sector_crc_from_disk(pretty_dev.phys_bdev_1->bd_disk, crc_sector);
+static void pretty_sb_init(void)
+{
+	spin_lock_init(&pretty_dev.leg_lock);
+	INIT_LIST_HEAD(&pretty_dev.sb_waiters);
+	INIT_WORK(&pretty_dev.sb_work, pretty_sb_update);
+}
 
-				buffer_crc_disk1 = kmap_atomic(page_crc_disk1);
+static void pretty_sb_exit(void)
+{
+	if (pretty_dev.sb_page)
+		__free_page(pretty_dev.sb_page);
+	pretty_dev.sb_page = NULL;
+}
 
-				if (memcmp(buffer_crc_disk1 + crc_offset, &checksum_disk1, sizeof(unsigned int)) == 0) {
-					/* DATA IS CORRECT ON DISK1 */
-					kunmap_atomic(buffer_crc_disk1);
+/* Re-add: a failed or missing leg is opened again from its path and
+ * rebuilt by a resync pass while it takes every write. A leg that still has
+ * the superblock of the array only gets the regions the write-intent bitmap
+ * kept dirty since it left, any other leg the whole disk.
+ */
+/* The leg was part of this array and left it while the bitmap kept every
+ * write since: same identity and format in its superblock, last written
+ * between the moment the whole array lost a leg and now. Anything else,
+ * an older copy or a disk from another array, is rebuilt in full.
+ */
+static bool pretty_leg_is_member(struct block_device *bdev)
+{
+	struct ssr_superblock *sb, *leg_sb;
+	struct page *page;
+	u64 events;
+	bool member;
+
+	if (!pretty_dev.sb_page)
+		return false;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return false;
+	sb = page_address(pretty_dev.sb_page);
+	leg_sb = page_address(page);
+
+	member = pretty_sb_read(bdev, leg_sb, page) && !memcmp(leg_sb->uuid, sb->uuid, sizeof(sb->uuid)) &&
+		leg_sb->csum_alg == sb->csum_alg && leg_sb->csum_block == sb->csum_block &&
+		leg_sb->data_sectors == sb->data_sectors && leg_sb->bitmap_shift == sb->bitmap_shift;
+	if (member) {
+		events = le64_to_cpu(leg_sb->events);
+		member = sb->failed_legs && events >= le64_to_cpu(sb->degraded_events) &&
+			 events <= le64_to_cpu(sb->events);
+	}
+	__free_page(page);
 
-					/* copy data from disk1's data page to initial bio's page */
-					initial_buffer = kmap_atomic(bvec.bv_page);
-					buffer_data_disk1 = kmap_atomic(page_data_disk1);
+	return member;
+}
 
-					memcpy(initial_buffer + bvec.bv_offset + j * KERNEL_SECTOR_SIZE, buffer_data_disk1 + j * KERNEL_SECTOR_SIZE, KERNEL_SECTOR_SIZE);
+/* A spare is opened ahead of time and swapped in for a leg, the leg it
+ * replaces is left out first so nothing reads it while the spare is rebuilt.
+ */
+#define SPARE_PATH_MAX		256
 
-					kunmap_atomic(buffer_data_disk1);
-					kunmap_atomic(initial_buffer);
+static DEFINE_MUTEX(legs_mutex);									// re-add, spare and replace
+static struct block_device *spare_bdev;
+static char spare_path[SPARE_PATH_MAX];
+static char leg_path_buf[SSR_MAX_LEGS][SPARE_PATH_MAX];			// paths of the legs swapped in
 
-					/* VERIFY DATA IS CORRECT ON DISK2 as well, if not => recover from DISK1 */
+/* the legs parameter until a spare took the place of the leg, legs_mutex held */
+static const char *pretty_leg_path(int leg)
+{
+	return leg_path_buf[leg][0] ? leg_path_buf[leg] : leg_paths[leg];
+}
 
-					/* read data from disk2 */
-					page_data_disk2 = read_sector_data_from_disk(pretty_dev.phys_bdev_2->bd_disk, data_sector, bvec.bv_len);
+static struct block_device *pretty_leg_open(const char *path)
+{
+	struct block_device *bdev = open_disk((char *)path);
 
-					checksum_disk2 = compute_crc(page_data_disk2, 0);
+	if (IS_ERR(bdev)) {
+		pr_err("unable to open %s: %ld\n", path, PTR_ERR(bdev));
+		return bdev;
+	}
+	if (pretty_leg_sectors(bdev) < pretty_leg_min_sectors()) {
+		pr_err("%s is smaller than the array\n", path);
+		close_disk(bdev);
+		return ERR_PTR(-ENOSPC);
+	}
 
-					if (memcmp(&checksum_disk1, &checksum_disk2, sizeof(unsigned int)) != 0) {
-						/* INCORRECT DATA ON DISK 2 => copy from DISK1 on DISK2 */
+	return bdev;
+}
 
-						/* write sector on disk2 */
-						write_from_disk_to_disk(page_data_disk1, pretty_dev.phys_bdev_2->bd_disk, data_sector);
+/* Put bdev in the place of leg, out of the array by now. The queue is
+ * frozen, which waits for every bio of the array and all of its stages,
+ * those run by pretty_queue_rq() and the scrub and resync chunks included,
+ * and holds off new ones, see pretty_queue_enter(). The superblock update that may
+ * still write the leg is waited for, the CRC write-back and the bitmap hold
+ * the legs they write in flight, see pretty_get_writable_legs(). Once the
+ * last bio of the leg completed the old device is closed.
+ */
+static void pretty_leg_swap(int leg, struct block_device *bdev)
+{
+	struct request_queue *q = pretty_dev.gd->queue;
+	struct block_device *old = pretty_dev.legs[leg];
 
-						/* write crc sector data into disk2 crc sector */
-						write_from_disk_to_disk(page_crc_disk1, pretty_dev.phys_bdev_2->bd_disk, crc_sector);
-					}
+	blk_mq_freeze_queue(q);
+	flush_work(&pretty_dev.sb_work);
 
-				} else {
-					/* DATA IS INCORRECT ON DISK1 */
-					kunmap_atomic(buffer_crc_disk1);
+	wait_var_event(&pretty_dev.inflight[leg], !atomic_read(&pretty_dev.inflight[leg]));
 
-					/* read data from disk2 */
-					page_data_disk2 = read_sector_data_from_disk(pretty_dev.phys_bdev_2->bd_disk, data_sector, bvec.bv_len);
+	/* the same device opened again holds a reference of its own */
+	WRITE_ONCE(pretty_dev.legs[leg], bdev);
+	blk_mq_unfreeze_queue(q);
 
-					checksum_disk2 = compute_crc(page_data_disk2, 0);
+	if (old)
+		close_disk(old);
+}
 
-					/* read crc from disk2 */
-					page_crc_disk2 = read_sector_crc_from_disk(pretty_dev.phys_bdev_2->bd_disk, crc_sector);
+static int pretty_leg_re_add(int leg)
+{
+	struct block_device *bdev;
+	bool delta;
+	int err;
 
-					buffer_crc_disk2 = kmap_atomic(page_crc_disk2);
+	if (leg < 0 || leg >= pretty_dev.nr_legs)
+		return -EINVAL;
+	if ((pretty_writable_legs() & BIT(leg)) || READ_ONCE(resync.state) != RESYNC_IDLE)
+		return -EBUSY;
 
-					if (memcmp(buffer_crc_disk2 + crc_offset, &checksum_disk2, sizeof(unsigned int)) == 0) {
-						/* CRC CORRECT ON DISK2 => start disk1 recovery */
-						kunmap_atomic(buffer_crc_disk2);
+	/* the same holder can open it again while the old one is still held */
+	bdev = pretty_leg_open(pretty_leg_path(leg));
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
 
-						/* copy data in original bio_vec page */
-						initial_buffer = kmap_atomic(bvec.bv_page);
-						buffer_data_disk2 = kmap_atomic(page_data_disk2);
+	delta = pretty_leg_is_member(bdev) && pretty_bitmap_rebuild();
+	pretty_leg_swap(leg, bdev);
 
-						memcpy(initial_buffer + bvec.bv_offset + j * KERNEL_SECTOR_SIZE, buffer_data_disk2, KERNEL_SECTOR_SIZE);
+	err = pretty_resync_begin(delta, BIT(leg));
+	if (!err)
+		pr_info("leg %d re-added, %s rebuild\n", leg, delta ? "bitmap" : "full");
 
-						kunmap_atomic(buffer_data_disk2);
-						kunmap_atomic(initial_buffer);
+	return err;
+}
 
-						/* write sector on disk1 */
-						write_from_disk_to_disk(page_data_disk2, pretty_dev.phys_bdev_1->bd_disk, data_sector);
+/* the spare takes the place of leg, active or not, and is rebuilt in full */
+static int pretty_leg_replace(int leg)
+{
+	int err;
 
-						/* write crc sector data into disk1 crc sector */
-						write_from_disk_to_disk(page_crc_disk2, pretty_dev.phys_bdev_1->bd_disk, crc_sector);
+	if (leg < 0 || leg >= pretty_dev.nr_legs)
+		return -EINVAL;
+	if (!spare_bdev)
+		return -ENODEV;
+	if (READ_ONCE(resync.state) != RESYNC_IDLE)
+		return -EBUSY;
+	/* a failed or missing leg is already out, the last good copy cannot go */
+	if (!pretty_leg_remove(leg, "replaced"))
+		return -EBUSY;
 
-					} else {
-						/* INCORRECT DATA ON DISK1 and DISK2 */
-						kunmap_atomic(buffer_crc_disk2);
-						err = 1;
-					}
+	pretty_leg_swap(leg, spare_bdev);
+	spare_bdev = NULL;
+	strscpy(leg_path_buf[leg], spare_path, SPARE_PATH_MAX);
+	spare_path[0] = '\0';
 
-					__free_page(page_data_disk2);
-					__free_page(page_crc_disk2);
-				}
+	err = pretty_resync_begin(false, BIT(leg));
+	if (!err)
+		pr_info("leg %d replaced by %s, full rebuild\n", leg, pretty_leg_path(leg));
 
-				__free_page(page_crc_disk1);
-			}
+	return err;
+}
 
-			__free_page(page_data_disk1);
+/* an empty path or "none" detaches the spare */
+static int pretty_spare_attach(const char *path)
+{
+	struct block_device *bdev = NULL;
+	char buf[SPARE_PATH_MAX];
+	bool busy = false;
+	int leg;
+
+	strscpy(buf, path, SPARE_PATH_MAX);
+	strim(buf);
+
+	if (buf[0] && strcmp(buf, "none")) {
+		bdev = pretty_leg_open(buf);
+		if (IS_ERR(bdev))
+			return PTR_ERR(bdev);
+
+		/* the module holds its legs already, opening one again succeeds */
+		for (leg = 0; leg < pretty_dev.nr_legs; leg++)
+			busy |= pretty_dev.legs[leg] == bdev;
+		if (busy || bdev == spare_bdev) {
+			close_disk(bdev);
+			return -EBUSY;
 		}
 	}
 
-	if (err == 1)
-		bio_io_error(my_bio);
-	else
-		bio_endio(my_bio);
-}
+	if (spare_bdev)
+		close_disk(spare_bdev);
+	spare_bdev = bdev;
+	strscpy(spare_path, bdev ? buf : "", SPARE_PATH_MAX);
 
-static int pretty_block_open(struct block_device *bdev, fmode_t mode)
-{
 	return 0;
 }
 
-static void pretty_block_release(struct gendisk *gd, fmode_t mode)
+static void pretty_spare_exit(void)
 {
+	if (spare_bdev)
+		close_disk(spare_bdev);
+	spare_bdev = NULL;
 }
 
-static blk_qc_t pretty_submit_bio(struct bio *bio)
+static int re_add_set(const char *val, const struct kernel_param *kp)
 {
-	struct pretty_bio *new_bio;
-
-	new_bio = kmalloc(sizeof(struct pretty_bio), GFP_ATOMIC);
-	if (new_bio == NULL)
-		return -1;
+	int leg, err = kstrtoint(val, 0, &leg);
 
-	new_bio->bio = bio;
-	INIT_WORK(&new_bio->work, work_handler);
+	if (err)
+		return err;
 
-	/* add work to queue */
-	queue_work(pretty_dev.queue, &new_bio->work);
+	mutex_lock(&legs_mutex);
+	err = pretty_leg_re_add(leg);
+	mutex_unlock(&legs_mutex);
 
-	return BLK_QC_T_NONE;
+	return err;
 }
 
-static const struct block_device_operations pretty_block_ops = {
-	.owner = THIS_MODULE,
-	.open = pretty_block_open,
-	.release = pretty_block_release,
-	.submit_bio = pretty_submit_bio,
+static const struct kernel_param_ops re_add_ops = {
+	.set = re_add_set,
 };
 
-static int create_block_device(struct pretty_block_dev *dev)
+static int replace_set(const char *val, const struct kernel_param *kp)
 {
-	int err = 0;
+	int leg, err = kstrtoint(val, 0, &leg);
 
-	/* initialize the gendisk structure */
-	dev->gd = alloc_disk(SSR_NUM_MINORS);
-	if (!dev->gd) {
-		pr_err("alloc_disk: failure\n");
-		err = -ENOMEM;
-		goto out;
-	}
-	blk_alloc_queue(NUMA_NO_NODE);
+	if (err)
+		return err;
 
-	dev->gd->major = SSR_MAJOR;
-	dev->gd->first_minor = SSR_FIRST_MINOR;
-	dev->gd->fops = &pretty_block_ops;
-	dev->gd->private_data = dev;
-	dev->gd->queue = blk_alloc_queue(NUMA_NO_NODE);
+	mutex_lock(&legs_mutex);
+	err = pretty_leg_replace(leg);
+	mutex_unlock(&legs_mutex);
 
-	snprintf(dev->gd->disk_name, 4, "ssr");
-	set_capacity(dev->gd, LOGICAL_DISK_SECTORS);
+	return err;
+}
 
-	add_disk(dev->gd);
+static const struct kernel_param_ops replace_ops = {
+	.set = replace_set,
+};
 
-	return 0;
+static int spare_set(const char *val, const struct kernel_param *kp)
+{
+	int err;
+
+	mutex_lock(&legs_mutex);
+	err = pretty_spare_attach(val);
+	mutex_unlock(&legs_mutex);
 
-out:
 	return err;
 }
 
-static struct block_device *open_disk(char *name)
+static int spare_get(char *buffer, const struct kernel_param *kp)
 {
-	struct block_device *bdev;
+	int len;
 
-	bdev = blkdev_get_by_path(name, FMODE_READ | FMODE_WRITE | FMODE_EXCL, THIS_MODULE);
+	mutex_lock(&legs_mutex);
+	len = sprintf(buffer, "%s\n", spare_bdev ? spare_path : "none");
+	mutex_unlock(&legs_mutex);
 
-	return bdev;
+	return len;
 }
 
-static void close_disk(struct block_device *bdev)
+static const struct kernel_param_ops spare_ops = {
+	.set = spare_set,
+	.get = spare_get,
+};
+
+enum {
+	LEG_ACTIVE,
+	LEG_REBUILDING,
+	LEG_FAILED,
+	LEG_MISSING,
+};
+
+static const char * const leg_state_names[] = {
+	[LEG_ACTIVE] = "active",
+	[LEG_REBUILDING] = "rebuilding",
+	[LEG_FAILED] = "failed",
+	[LEG_MISSING] = "missing",
+};
+
+/* one line per leg: index, path and state */
+static int legs_state_get(char *buffer, const struct kernel_param *kp)
 {
-	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	unsigned long active = READ_ONCE(pretty_dev.active), rebuilding = READ_ONCE(pretty_dev.rebuilding);
+	int leg, len = 0, state;
+
+	mutex_lock(&legs_mutex);
+	for (leg = 0; leg < pretty_dev.nr_legs; leg++) {
+		if (active & BIT(leg))
+			state = LEG_ACTIVE;
+		else if (rebuilding & BIT(leg))
+			state = LEG_REBUILDING;
+		else if (pretty_dev.legs[leg])
+			state = LEG_FAILED;
+		else
+			state = LEG_MISSING;
+
+		len += scnprintf(buffer + len, PAGE_SIZE - len, "%d %s %s\n", leg, pretty_leg_path(leg),
+				 leg_state_names[state]);
+	}
+	mutex_unlock(&legs_mutex);
+
+	return len;
 }
 
+static const struct kernel_param_ops legs_state_ops = {
+	.get = legs_state_get,
+};
+
+module_param_cb(re_add, &re_add_ops, NULL, 0200);
+MODULE_PARM_DESC(re_add, "Put a failed or missing leg back into the array by index and rebuild it");
+module_param_cb(spare, &spare_ops, NULL, 0644);
+MODULE_PARM_DESC(spare, "Path of a spare disk held for replace, none to detach it");
+module_param_cb(replace, &replace_ops, NULL, 0200);
+MODULE_PARM_DESC(replace, "Swap the spare in for a leg by index, failed or not, and rebuild it in the background");
+module_param_cb(legs_state, &legs_state_ops, NULL, 0444);
+MODULE_PARM_DESC(legs_state, "State of every leg: active, rebuilding, failed or missing");
+
 static void delete_block_device(struct pretty_block_dev *dev)
 {
 	if (dev->gd) {
 		del_gendisk(dev->gd);
+		blk_cleanup_queue(dev->gd->queue);
+		if (use_mq)
+			blk_mq_free_tag_set(&dev->tag_set);
 		put_disk(dev->gd);
 	}
 }
@@ -428,47 +5364,113 @@ static int __init ssr_init(void)
 		return -EBUSY;
 	}
 
-	err = create_block_device(&pretty_dev);
+	err = open_legs();
+	if (!err && create && pretty_degraded())
+		err = -ENODEV;														// a new array needs every leg
 	if (err)
-		goto out;
+		goto out_close_legs;
 
-	pretty_dev.phys_bdev_1 = open_disk(PHYSICAL_DISK1_NAME);
-	if (pretty_dev.phys_bdev_1 == NULL) {
-		pr_err("%s No such device\n", PHYSICAL_DISK1_NAME);
-		err = -EINVAL;
-		goto out_delete_logical_block_device;
-	}
+	/* init work_queue */
+	spin_lock_init(&pretty_dev.range_lock);
+	pretty_dev.range_tree = RB_ROOT_CACHED;
+	pretty_flush_init();
+	pretty_sb_init();
 
-	pretty_dev.phys_bdev_2 = open_disk(PHYSICAL_DISK2_NAME);
-	if (pretty_dev.phys_bdev_2 == NULL) {
-		pr_err("%s No such device\n", PHYSICAL_DISK2_NAME);
-		err = -EINVAL;
-		goto out_close_phys_block_device;
+	err = pretty_sb_load();
+	if (err)
+		goto out_close_legs;
+
+	err = pretty_csum_init(pretty_dev.csum_alg);
+	if (err)
+		goto out_close_legs;
+
+	err = pretty_mem_init();
+	if (err)
+		goto out_csum_exit;
+
+	pretty_dev.queue = alloc_workqueue("pretty_queue", WQ_MEM_RECLAIM | (workers_unbound ? WQ_UNBOUND : 0),
+					   max_workers ? max_workers : WQ_DFL_ACTIVE);
+	if (!pretty_dev.queue) {
+		err = -ENOMEM;
+		goto out_mem_exit;
 	}
 
-	/* init work_queue */
-	pretty_dev.queue = create_singlethread_workqueue("pretty_queue");
+	/* legs missing since the last load */
+	if (pretty_dev.sb_changed)
+		queue_work(pretty_dev.queue, &pretty_dev.sb_work);
 
-	return 0;
+	err = crc_cache_init();
+	if (err)
+		goto out_destroy_queue;
+
+	err = pretty_bitmap_init();
+	if (err)
+		goto out_crc_cache_exit;
+
+	err = pretty_resync_init();
+	if (err)
+		goto out_bitmap_exit;
+
+	/* /dev/ssr goes live last, once everything it needs is there */
+	err = create_block_device(&pretty_dev);
+	if (err)
+		goto out_resync_exit;
+
+	err = pretty_scrub_init();
+	if (err)
+		goto out_delete_logical_block_device;
 
-out_close_phys_block_device:
-	close_disk(pretty_dev.phys_bdev_1);
-	close_disk(pretty_dev.phys_bdev_2);
+	/* the array went down with writes in flight */
+	if (bitmap.resync)
+		pretty_resync_begin(true, 0);
+
+	return 0;
 
 out_delete_logical_block_device:
 	delete_block_device(&pretty_dev);
 
-out:
+out_resync_exit:
+	pretty_resync_exit();
+
+out_bitmap_exit:
+	pretty_bitmap_exit(false);
+
+out_crc_cache_exit:
+	crc_cache_exit();
+
+out_destroy_queue:
+	destroy_workqueue(pretty_dev.queue);
+
+out_mem_exit:
+	pretty_mem_exit();
+
+out_csum_exit:
+	pretty_csum_exit();
+
+out_close_legs:
+	pretty_sb_exit();
+	close_legs();
+
 	unregister_blkdev(SSR_MAJOR, "ssr");
 	return err;
 }
 
 static void __exit ssr_exit(void)
 {
-	close_disk(pretty_dev.phys_bdev_1);
-	close_disk(pretty_dev.phys_bdev_2);
-
+	pretty_scrub_exit();
+	pretty_resync_exit();
 	delete_block_device(&pretty_dev);
+
+	/* the bitmap is cleared once the cached CRCs are on the legs as well */
+	pretty_bitmap_exit(crc_cache_exit());
+	destroy_workqueue(pretty_dev.queue);
+	pretty_mem_exit();
+	pretty_csum_exit();
+
+	pretty_sb_exit();
+	pretty_spare_exit();
+	close_legs();
+
 	unregister_blkdev(SSR_MAJOR, "ssr");
 }
 
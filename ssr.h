@@ -7,22 +7,61 @@
 #ifndef SSR_H_
 #define SSR_H_	1
 
+#include <linux/types.h>
+
 #define SSR_MAJOR	240
 #define SSR_FIRST_MINOR		0
 #define SSR_NUM_MINORS	1
 
+/* legs of the mirror, see the legs module parameter */
+#define SSR_MAX_LEGS	8
+
+/* default legs */
 #define PHYSICAL_DISK1_NAME		"/dev/vdb"
 #define PHYSICAL_DISK2_NAME		"/dev/vdc"
 
 /* sector size */
 #define KERNEL_SECTOR_SIZE	512
 
-/* physical partition size - 95 MB (more than this results in error) */
+/* size of the arrays from before the superblock - 95 MB, new arrays take the size of the smaller leg */
 #define LOGICAL_DISK_NAME	"/dev/ssr"
 #define LOGICAL_DISK_SIZE	(95 * 1024 * 1024)
 #define LOGICAL_DISK_SECTORS	((LOGICAL_DISK_SIZE) / (KERNEL_SECTOR_SIZE))
 
-/* sync data */
+/* full resync of the legs, the argument is SSR_SYNC_START or SSR_SYNC_CANCEL */
 #define SSR_IOCTL_SYNC	1
+#define SSR_SYNC_START	0
+#define SSR_SYNC_CANCEL	1
+
+/* on-disk superblock, in the last SSR_SB_SECTORS sectors of every leg;
+ * legs without one use the original format: crc32 of every sector
+ */
+#define SSR_SB_MAGIC	0x3144494152525353ULL		/* "SSRRAID1" */
+#define SSR_SB_VERSION	2
+#define SSR_SB_V1_SIZE	64		/* version 1 ended after events with 3 reserved words and sb_crc */
+#define SSR_SB_SECTORS	8
+
+/* checksum algorithms */
+#define SSR_CSUM_CRC32	0
+#define SSR_CSUM_CRC32C	1
+#define SSR_CSUM_XXHASH64	2
+#define SSR_CSUM_NONE	3		/* plain mirror, no CRC area */
+#define SSR_CSUM_NR		4
+
+struct ssr_superblock {
+	__le64 magic;
+	__le32 version;
+	__le32 csum_alg;
+	__le32 csum_block;	/* bytes covered by one checksum, 0 for KERNEL_SECTOR_SIZE */
+	__le32 pad;
+	__le64 data_sectors;	/* size of the array, 0 for LOGICAL_DISK_SECTORS */
+	__le32 bitmap_shift;	/* log2 of the sectors per write-intent bit, 0 without bitmap */
+	__le32 failed_legs;	/* legs left out of the array, to rebuild before they are read again */
+	__le64 events;		/* bumped on every update, the legs with the highest one are current */
+	__u8 uuid[16];		/* identity of the array, random at creation */
+	__le64 degraded_events;	/* events when the whole array last lost a leg, the bitmap covers every write since */
+	__le32 sb_crc;		/* crc32 of the superblock with sb_crc set to 0 */
+	__le32 reserved;
+};
 
 #endif